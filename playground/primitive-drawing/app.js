@@ -19,6 +19,9 @@ const copySvgBtn = document.getElementById('copy-svg-btn');
 const useTrianglesCheckbox = document.getElementById('use-triangles');
 const useRectanglesCheckbox = document.getElementById('use-rectangles');
 const useEllipsesCheckbox = document.getElementById('use-ellipses');
+const useRotatedRectanglesCheckbox = document.getElementById('use-rotated-rectangles');
+const useRotatedEllipsesCheckbox = document.getElementById('use-rotated-ellipses');
+const pruneShapesCheckbox = document.getElementById('prune-shapes');
 const originalWrapper = document.getElementById('original-wrapper');
 const resultWrapper = document.getElementById('result-wrapper');
 const uploadLabel = document.getElementById('upload-label');
@@ -30,6 +33,8 @@ const controlElements = document.querySelectorAll('.form-grid select, .form-grid
 let sourceImage = null;
 let optimizerPtr = null;
 let wasmInstance = null;
+let enginePromise = null;
+let engineIsCurrent = false;
 let processingWidth = 256;
 let processingHeight = 256;
 let outputWidth = 256;
@@ -41,7 +46,17 @@ let currentStep = 0;
 let totalSteps = 0;
 let startTime = 0;
 let copyInProgress = false;
-let rawSvgData = null; // Store raw SVG data for debugging
+
+// Ceiling for engine allocations; large inputs fail fast instead of growing the heap until the tab dies
+const ENGINE_MEMORY_LIMIT = 512 * 1024 * 1024;
+
+// Shapes whose removal costs less than this many similarity points are dropped after a run
+const PRUNE_THRESHOLD = 0.002;
+
+// Engine exports added after the first wasm build; an older primitive.wasm lacks them
+const ENGINE_EXPORTS = [
+  'set_memory_limit', 'run_partitioned_optimization', 'prune_optimizer_shapes', 'export_svg_scaled', 'load_next_frame'
+];
 
 // Initialize when DOM is loaded
 document.addEventListener('DOMContentLoaded', initialize);
@@ -59,6 +74,7 @@ function initialize() {
   setupShapeTypeToggles();
   setupSliders();
   setupTabs();
+  loadEngine().catch(error => console.error('Error loading WebAssembly module:', error));
   setTimeout(loadDefaultImage, 500);
   
   // Observe canvas resize
@@ -76,86 +92,6 @@ function initialize() {
   });
 }
 
-// Transform SVG shapes - convert polygons to rectangles and fix triangles
-function transformSvgShapes(svgString) {
-  if (!svgString) return '';
-  
-  try {
-    // Create a DOM parser to properly handle the SVG
-    const parser = new DOMParser();
-    const svgDoc = parser.parseFromString(svgString, 'image/svg+xml');
-    
-    // Check for parsing errors
-    const parserError = svgDoc.querySelector('parsererror');
-    if (parserError) {
-      console.error("SVG parsing error:", parserError.textContent);
-      return svgString; // Return original if parsing fails
-    }
-    
-    // Process all polygon elements
-    svgDoc.querySelectorAll('polygon').forEach(polygon => {
-      const points = polygon.getAttribute('points');
-      if (!points) return;
-      
-      // Split points into an array of coordinates
-      const coords = points.trim().split(/\s+|,/).map(parseFloat);
-      
-      // Check if this is a rectangle (4 points forming a rectangle)
-      if (coords.length === 8) {
-        // Extract the points
-        const x1 = coords[0];
-        const y1 = coords[1];
-        const x2 = coords[2];
-        const y2 = coords[3];
-        const x3 = coords[4];
-        const y3 = coords[5];
-        const x4 = coords[6];
-        const y4 = coords[7];
-        
-        // Check if these points form a rectangle (parallel sides)
-        // This is a simple check - we're looking for points forming a rectangle
-        if ((Math.abs(y1 - y2) < 0.001 && Math.abs(y3 - y4) < 0.001 && 
-             Math.abs(x1 - x4) < 0.001 && Math.abs(x2 - x3) < 0.001)) {
-          
-          // Create a new rect element
-          const rect = svgDoc.createElementNS("http://www.w3.org/2000/svg", "rect");
-          
-          // Set attributes
-          rect.setAttribute("x", Math.min(x1, x2, x3, x4));
-          rect.setAttribute("y", Math.min(y1, y2, y3, y4));
-          rect.setAttribute("width", Math.abs(x2 - x1));
-          rect.setAttribute("height", Math.abs(y3 - y2));
-          rect.setAttribute("fill", polygon.getAttribute("fill"));
-          
-          // Replace the polygon with the rect
-          polygon.parentNode.replaceChild(rect, polygon);
-        }
-      }
-      // If it's a triangle (3 points), ensure its format is correct
-      else if (coords.length === 6) {
-        // Make sure the points are properly formatted with commas
-        const formattedPoints = 
-          `${coords[0]},${coords[1]} ${coords[2]},${coords[3]} ${coords[4]},${coords[5]}`;
-        polygon.setAttribute('points', formattedPoints);
-      }
-    });
-    
-    // Set dimensions
-    const svgRoot = svgDoc.documentElement;
-    svgRoot.setAttribute('width', outputWidth);
-    svgRoot.setAttribute('height', outputHeight);
-    svgRoot.setAttribute('viewBox', `0 0 ${processingWidth} ${processingHeight}`);
-    svgRoot.setAttribute('preserveAspectRatio', 'xMidYMid meet');
-    
-    // Serialize back to string
-    const serializer = new XMLSerializer();
-    return serializer.serializeToString(svgDoc);
-  } catch (error) {
-    console.error("Error transforming SVG:", error);
-    return svgString; // Return original on error
-  }
-}
-
 // Setup tabs
 function setupTabs() {
   document.querySelectorAll('.svg-tab').forEach(tab => {
@@ -177,11 +113,16 @@ function setupTabs() {
 
 // Set up shape type toggle behavior
 function setupShapeTypeToggles() {
-  const shapeCheckboxes = [useTrianglesCheckbox, useRectanglesCheckbox, useEllipsesCheckbox];
+  const shapeCheckboxes = [
+    useTrianglesCheckbox, useRectanglesCheckbox, useEllipsesCheckbox,
+    useRotatedRectanglesCheckbox, useRotatedEllipsesCheckbox
+  ];
   const labels = [
     document.getElementById('triangles-label'),
     document.getElementById('rectangles-label'),
-    document.getElementById('ellipses-label')
+    document.getElementById('ellipses-label'),
+    document.getElementById('rotated-rectangles-label'),
+    document.getElementById('rotated-ellipses-label')
   ];
 
   // Add event listeners to checkboxes
@@ -206,6 +147,7 @@ function setupShapeTypeToggles() {
       // Only toggle if click wasn't directly on the checkbox
       if (e.target.tagName !== 'INPUT') {
         const checkbox = shapeCheckboxes[index];
+        if (checkbox.disabled) return;
         checkbox.checked = !checkbox.checked;
         
         // Toggle active class
@@ -488,57 +430,6 @@ function formatFileSize(bytes) {
   }
 }
 
-// Create a compact version of SVG - preserve exact shape data
-function createCompactSVG(svgString) {
-  if (!svgString) return '';
-  
-  // Try to use the transformer to create a cleaner SVG
-  try {
-    // Create a DOM parser to properly handle the SVG
-    const parser = new DOMParser();
-    const svgDoc = parser.parseFromString(svgString, 'image/svg+xml');
-    
-    // Check for parsing errors
-    const parserError = svgDoc.querySelector('parsererror');
-    if (parserError) {
-      console.error("SVG parsing error in compaction:", parserError.textContent);
-      return basicCompactSvg(svgString);
-    }
-    
-    // Remove whitespace from text nodes
-    const removeWhitespace = (node) => {
-      if (node.nodeType === 3) { // Text node
-        node.textContent = node.textContent.trim();
-      } else if (node.nodeType === 1) { // Element node
-        Array.from(node.childNodes).forEach(removeWhitespace);
-      }
-    };
-    
-    removeWhitespace(svgDoc.documentElement);
-    
-    // Serialize back to string
-    const serializer = new XMLSerializer();
-    let output = serializer.serializeToString(svgDoc);
-    
-    // Basic string cleanup
-    output = output.replace(/>\s+</g, '><').trim();
-    
-    return output;
-  } catch (error) {
-    console.error("Error in SVG compaction:", error);
-    return basicCompactSvg(svgString);
-  }
-}
-
-// Basic string-based SVG compaction as fallback
-function basicCompactSvg(svgString) {
-  return svgString
-    .replace(/>\s+</g, '><')   // Remove whitespace between tags
-    .replace(/\s+>/g, '>')     // Remove spaces before closing brackets
-    .replace(/<\s+/g, '<')     // Remove spaces after opening brackets
-    .trim();                   // Trim leading/trailing whitespace
-}
-
 // Update the result status
 function updateResultStatus(currentStep, totalSteps, similarity) {
   const elapsedTime = ((Date.now() - startTime) / 1000).toFixed(1);
@@ -616,7 +507,7 @@ function resetOptimizationState() {
 // Disable controls during processing
 function disableControls(disable) {
   controlElements.forEach(element => {
-    element.disabled = disable;
+    element.disabled = disable || (!engineIsCurrent && 'requiresCurrentEngine' in element.dataset);
   });
   
   if (!svgString || disable) {
@@ -629,36 +520,104 @@ function disableControls(disable) {
   }
 }
 
-// Get SVG string from optimizer with minimal processing
-function getRawSvgFromOptimizer() {
+// Load the wasm engine once; an older build also drops the settings it cannot handle
+function loadEngine() {
+  if (!enginePromise) {
+    enginePromise = PrimitiveModule().then(instance => {
+      wasmInstance = instance;
+      engineIsCurrent = checkEngineBuild();
+      if (!engineIsCurrent) restrictToLegacyEngine();
+      return instance;
+    }).catch(error => {
+      enginePromise = null;
+      throw error;
+    });
+  }
+  return enginePromise;
+}
+
+// Remove the large sizes, which an older engine would run without a memory
+// ceiling, and turn off the rotated shapes, which it ignores
+function restrictToLegacyEngine() {
+  let resized = false;
+  document.querySelectorAll('option[data-requires-current-engine]').forEach(option => {
+    const select = option.parentElement;
+    const wasSelected = option.selected;
+    option.remove();
+    if (wasSelected) {
+      select.selectedIndex = select.options.length - 1;
+      resized = true;
+    }
+  });
+  
+  if (resized) {
+    updateCanvasSizes();
+    drawOriginalImage();
+  }
+  
+  document.querySelectorAll('input[data-requires-current-engine]').forEach(checkbox => {
+    const label = checkbox.closest('.shape-option');
+    checkbox.checked = false;
+    checkbox.disabled = true;
+    checkbox.title = 'Needs a rebuilt primitive.wasm';
+    if (label) {
+      label.classList.remove('active');
+      label.classList.add('unavailable');
+      label.title = checkbox.title;
+    }
+  });
+  
+  // Keep at least one shape type selected
+  if (!useTrianglesCheckbox.checked && !useRectanglesCheckbox.checked && !useEllipsesCheckbox.checked) {
+    useTrianglesCheckbox.checked = true;
+    document.getElementById('triangles-label').classList.add('active');
+  }
+}
+
+// Whether the loaded wasm build exports an engine function
+function hasEngineFunction(name) {
+  return !!wasmInstance && typeof wasmInstance['_' + name] === 'function';
+}
+
+// Warn once when primitive.wasm predates primitive.c; the page then falls back to the older exports
+function checkEngineBuild() {
+  const missing = ENGINE_EXPORTS.filter(name => !hasEngineFunction(name));
+  if (missing.length > 0) {
+    console.warn(`primitive.wasm is older than primitive.c (missing ${missing.join(', ')}); ` +
+                 'rebuild it with the command in ./emcc. Large sizes, rotated shapes, region splitting and pruning are unavailable.');
+  }
+  return missing.length === 0;
+}
+
+// Read an SVG document written by the engine at the output size, then free its buffer
+function readSvgFromOptimizer(pretty) {
   if (!wasmInstance || !optimizerPtr) return null;
   
   try {
-    // Get the SVG string pointer
-    const svgStrPtr = wasmInstance.ccall(
-      'export_svg_string',
-      'number',
-      ['number'],
-      [optimizerPtr]
-    );
+    const scaled = hasEngineFunction('export_svg_scaled');
+    const svgStrPtr = scaled
+      ? wasmInstance.ccall(
+          'export_svg_scaled',
+          'number',
+          ['number', 'number', 'number', 'number'],
+          [optimizerPtr, outputWidth, outputHeight, pretty ? 1 : 0]
+        )
+      : wasmInstance.ccall('export_svg_string', 'number', ['number'], [optimizerPtr]);
     
     if (!svgStrPtr) return null;
     
-    // Convert the C string to a JavaScript string
-    let str = '';
-    let idx = svgStrPtr;
-    const maxLength = 1000000; // Increased for safety
-    let count = 0;
+    // Find the terminating zero and decode the C string in one go
+    let end = svgStrPtr;
+    while (wasmInstance.HEAPU8[end] !== 0) end++;
+    let str = new TextDecoder().decode(wasmInstance.HEAPU8.subarray(svgStrPtr, end));
     
-    while (wasmInstance.HEAPU8[idx] !== 0 && count < maxLength) {
-      str += String.fromCharCode(wasmInstance.HEAPU8[idx]);
-      idx++;
-      count++;
-    }
-    
-    // Store raw SVG for debugging
-    rawSvgData = str;
+    wasmInstance._free(svgStrPtr);
     
+    // Older builds write at the processing size with a viewBox; scale the root instead
+    if (!scaled) {
+      str = str.replace(/<svg([^>]*?) width="\d+" height="\d+"/, `<svg$1 width="${outputWidth}" height="${outputHeight}"`);
+      if (!pretty) str = str.replace(/>\s+</g, '><').trim();
+    }
     return str;
   } catch (error) {
     console.error('Error getting SVG from optimizer:', error);
@@ -666,22 +625,18 @@ function getRawSvgFromOptimizer() {
   }
 }
 
-// Process SVG - transform shapes and fix triangles
-function processSvg(rawSvg) {
-  if (!rawSvg) return;
+// Refresh the readable and compact SVG outputs from the engine
+function updateSvgOutput() {
+  const readableSvg = readSvgFromOptimizer(true);
+  if (!readableSvg) return;
   
-  try {
-    // Transform SVG - convert polygons to rectangles and fix triangles
-    svgString = transformSvgShapes(rawSvg);
-    svgCompactString = createCompactSVG(svgString);
-    
-    // Update output display
-    svgOutput.textContent = svgString;
-    svgOutputCompact.textContent = svgCompactString;
-    updateFileSizeInfo();
-  } catch (error) {
-    console.error("Error processing SVG:", error);
-  }
+  svgString = readableSvg;
+  svgCompactString = readSvgFromOptimizer(false) || readableSvg;
+  
+  // Update output display
+  svgOutput.textContent = svgString;
+  svgOutputCompact.textContent = svgCompactString;
+  updateFileSizeInfo();
 }
 
 // Start optimization
@@ -689,7 +644,8 @@ async function startOptimization() {
   if (isRunning || !sourceImage) return;
   
   // Check that at least one shape type is selected
-  if (!useTrianglesCheckbox.checked && !useRectanglesCheckbox.checked && !useEllipsesCheckbox.checked) {
+  if (!useTrianglesCheckbox.checked && !useRectanglesCheckbox.checked && !useEllipsesCheckbox.checked &&
+      !useRotatedRectanglesCheckbox.checked && !useRotatedEllipsesCheckbox.checked) {
     alert("Please select at least one shape type.");
     return;
   }
@@ -705,12 +661,10 @@ async function startOptimization() {
     svgOutputCompact.textContent = '';
     
     // Load WASM module if not already loaded
-    if (!wasmInstance) {
-      try {
-        wasmInstance = await PrimitiveModule();
-      } catch (error) {
-        throw new Error('Error loading WebAssembly module: ' + error.message);
-      }
+    try {
+      await loadEngine();
+    } catch (error) {
+      throw new Error('Error loading WebAssembly module: ' + error.message);
     }
     
     // Get parameters
@@ -724,8 +678,17 @@ async function startOptimization() {
     // Get image data
     const imageData = originalCtx.getImageData(0, 0, processingWidth, processingHeight);
     
+    // Release the previous run's optimizer before allocating the next one
+    if (optimizerPtr) {
+      wasmInstance.ccall('free_optimizer', null, ['number'], [optimizerPtr]);
+      optimizerPtr = null;
+    }
+    
     // Allocate memory for the image data
     const targetDataPtr = wasmInstance._malloc(imageData.data.length);
+    if (!targetDataPtr) {
+      throw new Error('Not enough memory for the input image');
+    }
     wasmInstance.HEAPU8.set(imageData.data, targetDataPtr);
     
     // Background color (white)
@@ -735,22 +698,35 @@ async function startOptimization() {
     const useTriangles = useTrianglesCheckbox.checked ? 1 : 0;
     const useRectangles = useRectanglesCheckbox.checked ? 1 : 0;
     const useEllipses = useEllipsesCheckbox.checked ? 1 : 0;
+    const useRotatedRectangles = useRotatedRectanglesCheckbox.checked ? 1 : 0;
+    const useRotatedEllipses = useRotatedEllipsesCheckbox.checked ? 1 : 0;
     
-    console.log(`Shape selection - Triangles: ${useTriangles}, Rectangles: ${useRectangles}, Ellipses: ${useEllipses}`);
+    console.log(`Shape selection - Triangles: ${useTriangles}, Rectangles: ${useRectangles}, Ellipses: ${useEllipses}, ` +
+                `Rotated rectangles: ${useRotatedRectangles}, Rotated ellipses: ${useRotatedEllipses}`);
     
-    // Create the optimizer
+    // Create the optimizer within the memory ceiling
+    if (engineIsCurrent) {
+      wasmInstance.ccall('set_memory_limit', null, ['number'], [ENGINE_MEMORY_LIMIT]);
+    }
     optimizerPtr = wasmInstance.ccall(
       'create_optimizer',
       'number',
-      ['number', 'number', 'number', 'number', 'number', 'number', 'number', 'number', 'number'],
-      [processingWidth, processingHeight, targetDataPtr, bgR, bgG, bgB, useTriangles, useRectangles, useEllipses]
+      ['number', 'number', 'number', 'number', 'number', 'number', 'number', 'number', 'number', 'number', 'number'],
+      [processingWidth, processingHeight, targetDataPtr, bgR, bgG, bgB, useTriangles, useRectangles, useEllipses,
+       useRotatedRectangles, useRotatedEllipses]
     );
     
     // Free the allocated memory
     wasmInstance._free(targetDataPtr);
     
+    if (!optimizerPtr) {
+      throw new Error(`${processingWidth}×${processingHeight} exceeds the memory limit, choose a smaller input size`);
+    }
+    
     // Run optimization in batches
-    const stepsPerBatch = 5;
+    const regionGrid = engineIsCurrent && processingWidth >= 2048 ? 2 : 1;
+    // A partitioned batch gives each region one step, keeping every call short
+    const stepsPerBatch = regionGrid > 1 ? regionGrid * regionGrid : 5;
     
     function runBatch() {
       if (currentStep >= totalSteps) {
@@ -760,13 +736,22 @@ async function startOptimization() {
       
       const batchSize = Math.min(stepsPerBatch, totalSteps - currentStep);
       
-      // Run a batch of steps
-      wasmInstance.ccall(
-        'run_optimization',
-        null,
-        ['number', 'number', 'number', 'number'],
-        [optimizerPtr, batchSize, shapeCandidates, numMutations]
-      );
+      // Run a batch of steps; large inputs are split into independently optimized regions
+      if (regionGrid > 1) {
+        wasmInstance.ccall(
+          'run_partitioned_optimization',
+          'number',
+          ['number', 'number', 'number', 'number', 'number'],
+          [optimizerPtr, regionGrid, batchSize, shapeCandidates, numMutations]
+        );
+      } else {
+        wasmInstance.ccall(
+          'run_optimization',
+          null,
+          ['number', 'number', 'number', 'number'],
+          [optimizerPtr, batchSize, shapeCandidates, numMutations]
+        );
+      }
       
       currentStep += batchSize;
       
@@ -788,11 +773,8 @@ async function startOptimization() {
       // Update result canvas
       updateResultCanvas();
       
-      // Get and process raw SVG
-      const rawSvg = getRawSvgFromOptimizer();
-      if (rawSvg) {
-        processSvg(rawSvg);
-      }
+      // Update the SVG output
+      updateSvgOutput();
       
       // Schedule next batch
       setTimeout(runBatch, 0);
@@ -839,12 +821,20 @@ function updateResultCanvas() {
 // Finalize optimization
 function finalizeOptimization() {
   try {
-    // Get and process final SVG
-    const finalSvg = getRawSvgFromOptimizer();
-    if (finalSvg) {
-      processSvg(finalSvg);
+    // Drop shapes that barely contribute and refit their neighbors
+    if (pruneShapesCheckbox.checked && hasEngineFunction('prune_optimizer_shapes')) {
+      wasmInstance.ccall(
+        'prune_optimizer_shapes',
+        'number',
+        ['number', 'number'],
+        [optimizerPtr, PRUNE_THRESHOLD]
+      );
+      updateResultCanvas();
     }
     
+    // Get the final SVG
+    updateSvgOutput();
+    
     // Update final status
     const similarity = wasmInstance.ccall(
       'get_current_similarity',
@@ -945,9 +935,9 @@ outputSizeSelect.addEventListener('change', function() {
     outputWidth = parseInt(outputSizeSelect.value, 10);
     outputHeight = outputWidth;
     
-    if (svgString && rawSvgData) {
-      // Re-process SVG with new dimensions
-      processSvg(rawSvgData);
+    if (svgString && optimizerPtr) {
+      // Re-export SVG with new dimensions
+      updateSvgOutput();
     }
   }
 });
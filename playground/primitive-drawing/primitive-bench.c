@@ -0,0 +1,514 @@
+// Benchmark of the primitive.c kernels, checked against the mask-based reference.
+// Exits non-zero on any mismatch
+#include "primitive.c"
+
+#define BENCH_SEED 12345
+#define BENCH_SHAPES 2000
+
+int bench_failures = 0;
+
+// Reference scorer for score_candidate_batch: scores one candidate row by row,
+// setting its optimal color, and returns a lower bound (>= bound) once it cannot win
+float score_candidate_bounded(State* state, Shape* shape, Coverage* coverage, float bound) {
+    int width = state->current->width;
+    compute_shape_coverage(width, state->current->height, *shape, coverage);
+    
+    // Largest possible improvement over the rows not yet scored
+    double remaining = 0;
+    for (int y = coverage->top; y <= coverage->bottom; y++) {
+        Span span = coverage->spans[y];
+        if (span.x0 <= span.x1) {
+            remaining += state->row_residuals[y * (width + 1) + span.x1 + 1] - state->row_residuals[y * (width + 1) + span.x0];
+        }
+    }
+    
+    CoverageStats stats;
+    memset(&stats, 0, sizeof(CoverageStats));
+    
+    for (int y = coverage->top; y <= coverage->bottom; y++) {
+        Span span = coverage->spans[y];
+        if (span.x0 > span.x1) continue;
+        
+        accumulate_span_stats(state->current, state->target, y, span.x0, span.x1, 1, &stats);
+        remaining -= state->row_residuals[y * (width + 1) + span.x1 + 1] - state->row_residuals[y * (width + 1) + span.x0];
+        
+        float lower_bound = min_difference_change(&stats, shape->alpha) - remaining;
+        if (lower_bound >= bound) {
+            return lower_bound;
+        }
+    }
+    
+    shape->color = compute_color_from_stats(&stats, shape->alpha);
+    return compute_difference_change_from_stats(&stats, shape->color, shape->alpha);
+}
+
+// Random shape of the given type whose extent is about size pixels
+Shape create_sized_shape(ShapeType type, int width, int height, int size) {
+    Shape shape;
+    memset(&shape, 0, sizeof(Shape));
+    shape.type = type;
+    shape.alpha = 0.1f + 0.9f * random_float();
+    shape.color = (Color){random_int(0, 255), random_int(0, 255), random_int(0, 255), 255};
+    
+    // Let shapes poke past the image edges to exercise clipping
+    int x = random_int(-size / 2, width - 1);
+    int y = random_int(-size / 2, height - 1);
+    
+    switch(type) {
+        case TRIANGLE:
+            shape.data.triangle.x1 = x + random_int(0, size);
+            shape.data.triangle.y1 = y + random_int(0, size);
+            shape.data.triangle.x2 = x + random_int(0, size);
+            shape.data.triangle.y2 = y + random_int(0, size);
+            shape.data.triangle.x3 = x + random_int(0, size);
+            shape.data.triangle.y3 = y + random_int(0, size);
+            shape.bbox.left = fmin(shape.data.triangle.x1, fmin(shape.data.triangle.x2, shape.data.triangle.x3));
+            shape.bbox.top = fmin(shape.data.triangle.y1, fmin(shape.data.triangle.y2, shape.data.triangle.y3));
+            shape.bbox.width = fmax(shape.data.triangle.x1, fmax(shape.data.triangle.x2, shape.data.triangle.x3)) - shape.bbox.left + 1;
+            shape.bbox.height = fmax(shape.data.triangle.y1, fmax(shape.data.triangle.y2, shape.data.triangle.y3)) - shape.bbox.top + 1;
+            break;
+            
+        case RECTANGLE:
+            shape.data.rectangle.x1 = x;
+            shape.data.rectangle.y1 = y;
+            shape.data.rectangle.x2 = x + random_int(0, size);
+            shape.data.rectangle.y2 = y + random_int(0, size);
+            shape.bbox = (BoundingBox){x, y, shape.data.rectangle.x2 - x + 1, shape.data.rectangle.y2 - y + 1};
+            break;
+            
+        case ELLIPSE:
+            shape.data.ellipse.cx = x + size / 2;
+            shape.data.ellipse.cy = y + size / 2;
+            shape.data.ellipse.rx = random_int(1, fmax(1, size / 2));
+            shape.data.ellipse.ry = random_int(1, fmax(1, size / 2));
+            shape.bbox.left = shape.data.ellipse.cx - shape.data.ellipse.rx;
+            shape.bbox.top = shape.data.ellipse.cy - shape.data.ellipse.ry;
+            shape.bbox.width = 2 * shape.data.ellipse.rx;
+            shape.bbox.height = 2 * shape.data.ellipse.ry;
+            break;
+            
+        case ROTATED_RECTANGLE:
+        case ROTATED_ELLIPSE:
+            shape.data.rotated.cx = x + size / 2;
+            shape.data.rotated.cy = y + size / 2;
+            shape.data.rotated.rx = random_int(1, fmax(1, size / 2));
+            shape.data.rotated.ry = random_int(1, fmax(1, size / 2));
+            shape.data.rotated.angle = random_int(0, 179);
+            update_rotated_bbox(&shape);
+            break;
+    }
+    
+    return shape;
+}
+
+Image* create_random_image(int width, int height) {
+    Image* img = create_image(width, height);
+    for (int i = 0; i < width * height * 4; i++) {
+        img->data[i] = rand() & 255;
+    }
+    return img;
+}
+
+void bench_check(int ok, const char* what, ShapeType type, int size) {
+    if (!ok) {
+        if (bench_failures < 20) printf("MISMATCH %s (type %d, size %d)\n", what, type, size);
+        bench_failures++;
+    }
+}
+
+// Compare every optimized kernel with the reference on one shape
+void check_shape(Image* current, Image* target, Shape shape, Shape other, int size) {
+    int width = current->width;
+    int height = current->height;
+    Coverage coverage = {global_span_buffers[0], 0, -1};
+    Coverage other_coverage = {global_span_buffers[1], 0, -1};
+    
+    // Coverage: exact pixel set of the mask rasterizer. Rotated shapes fill
+    // the mask from their spans, so they are checked against the point test.
+    int rotated = shape.type == ROTATED_RECTANGLE || shape.type == ROTATED_ELLIPSE;
+    float c = 0, s = 0;
+    if (rotated) rotation_of(shape.data.rotated.angle, &c, &s);
+    memset(global_mask_buffer, 0, width * height);
+    render_shape_to_mask(width, height, shape);
+    compute_shape_coverage(width, height, shape, &coverage);
+    int coverage_ok = 1;
+    for (int y = 0; y < height && coverage_ok; y++) {
+        for (int x = 0; x < width; x++) {
+            int in_bbox = x >= shape.bbox.left && x < shape.bbox.left + shape.bbox.width &&
+                          y >= shape.bbox.top && y < shape.bbox.top + shape.bbox.height;
+            int in_mask = rotated ? in_bbox && point_in_rotated_shape(&shape, c, s, x, y) : global_mask_buffer[y * width + x] > 0;
+            int in_span = y >= coverage.top && y <= coverage.bottom && x >= coverage.spans[y].x0 && x <= coverage.spans[y].x1;
+            if (in_mask != in_span) {
+                coverage_ok = 0;
+                break;
+            }
+        }
+    }
+    bench_check(coverage_ok, rotated ? "coverage vs point_in_rotated_shape" : "coverage vs render_shape_to_mask", shape.type, size);
+    
+    // Color and difference change from sums: within float rounding of the reference
+    CoverageStats stats;
+    compute_coverage_stats(current, target, &coverage, &stats);
+    Color reference_color = compute_optimal_color(current, target, shape);
+    Color color = compute_color_from_stats(&stats, shape.alpha);
+    bench_check(abs(color.r - reference_color.r) <= 1 && abs(color.g - reference_color.g) <= 1 && abs(color.b - reference_color.b) <= 1,
+                "compute_color_from_stats vs compute_optimal_color", shape.type, size);
+    
+    float reference_difference = compute_difference_change_direct(current, target, shape, reference_color);
+    float difference = compute_difference_change_from_stats(&stats, reference_color, shape.alpha);
+    bench_check(fabs(difference - reference_difference) <= 1e-4 * fabs(reference_difference) + 1.0f,
+                "compute_difference_change_from_stats vs compute_difference_change_direct", shape.type, size);
+    
+    // Incremental update from another shape's sums: exact
+    CoverageStats updated;
+    compute_shape_coverage(width, height, other, &other_coverage);
+    compute_coverage_stats(current, target, &other_coverage, &updated);
+    update_coverage_stats(current, target, &other_coverage, &coverage, &updated);
+    bench_check(memcmp(&updated, &stats, sizeof(CoverageStats)) == 0, "update_coverage_stats vs compute_coverage_stats", shape.type, size);
+}
+
+// Bounded scoring must match the unbounded score, and only abandon candidates
+// whose true score does not beat the bound
+void check_bounded_score(State* state, Shape shape, int size) {
+    Coverage coverage = {global_span_buffers[0], 0, -1};
+    CoverageStats stats;
+    
+    compute_shape_coverage(state->current->width, state->current->height, shape, &coverage);
+    compute_coverage_stats(state->current, state->target, &coverage, &stats);
+    Color color = compute_color_from_stats(&stats, shape.alpha);
+    float expected = compute_difference_change_from_stats(&stats, color, shape.alpha);
+    
+    Shape scored = shape;
+    float unbounded = score_candidate_bounded(state, &scored, &coverage, INFINITY);
+    bench_check(unbounded == expected && scored.color.r == color.r && scored.color.g == color.g && scored.color.b == color.b,
+                "score_candidate_bounded without bound", shape.type, size);
+    
+    float bound = expected * (random_float() * 2.0f - 0.5f);
+    float bounded = score_candidate_bounded(state, &scored, &coverage, bound);
+    bench_check(bounded == expected || (bounded >= bound && bounded <= expected + fabsf(expected) * 1e-5f + 1.0f),
+                "score_candidate_bounded with bound", shape.type, size);
+}
+
+// Batched scoring must find the same best candidate as scoring one at a time,
+// with exact scores for finished candidates and valid lower bounds for the rest
+void check_batch_score(State* state, int size) {
+    Candidate candidates[CANDIDATE_BATCH];
+    Candidate* batch[CANDIDATE_BATCH];
+    float expected[CANDIDATE_BATCH];
+    float best_difference = INFINITY;
+    Coverage coverage = {global_span_buffers[0], 0, -1};
+    
+    for (int k = 0; k < CANDIDATE_BATCH; k++) {
+        Shape shape = create_sized_shape(random_int(TRIANGLE, ROTATED_ELLIPSE), state->current->width, state->current->height, size);
+        candidates[k] = (Candidate){.shape = shape, .score = -INFINITY};
+        batch[k] = &candidates[k];
+        expected[k] = score_candidate_bounded(state, &shape, &coverage, INFINITY);
+        best_difference = fmin(best_difference, expected[k]);
+    }
+    
+    int best = score_candidate_batch(state, batch, CANDIDATE_BATCH, INFINITY);
+    bench_check(best >= 0 && candidates[best].score == best_difference, "score_candidate_batch best", TRIANGLE, size);
+    
+    for (int k = 0; k < CANDIDATE_BATCH; k++) {
+        int ok = candidates[k].exact ? candidates[k].score == expected[k]
+                                     : candidates[k].score <= expected[k] + fabsf(expected[k]) * 1e-5f + 1.0f;
+        bench_check(ok, "score_candidate_batch vs score_candidate_bounded", candidates[k].shape.type, size);
+    }
+}
+
+// Pooled candidates still marked exact must score the same against the
+// current canvas as a fresh unbounded score
+void check_candidate_pool(State* state, const char* what) {
+    Coverage coverage = {global_span_buffers[0], 0, -1};
+    
+    for (int i = 0; i < state->pool_size; i++) {
+        Candidate* candidate = &state->pool[i];
+        if (!candidate->exact) continue;
+        
+        Shape shape = candidate->shape;
+        float score = score_candidate_bounded(state, &shape, &coverage, INFINITY);
+        bench_check(score == candidate->score, what, shape.type, state->current->width);
+    }
+}
+
+// Gradient with a disc centered at (disc_x, height / 3). Noise targets leave
+// nothing to prune or refit, so the state checks use this instead.
+Image* create_disc_image(int width, int height, int disc_x) {
+    Image* img = create_image(width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char* pixel = &img->data[(y * width + x) * 4];
+            int dx = x - disc_x;
+            int dy = y - height / 3;
+            pixel[0] = x * 255 / width;
+            pixel[1] = y * 255 / height;
+            pixel[2] = dx * dx + dy * dy < width * height / 16 ? 220 : 30;
+            pixel[3] = 255;
+        }
+    }
+    return img;
+}
+
+// The canvas and distance of a state must match rendering its shapes from scratch
+void check_full_render(State* state, const char* what) {
+    int width = state->current->width;
+    int height = state->current->height;
+    Image* expected = create_image(width, height);
+    fill_image(expected, state->background);
+    for (int i = 0; i < state->shape_count; i++) render_shape(expected, state->shapes[i]);
+    float expected_distance = distance_from_error(compute_region_error(expected, state->target, 0, 0, width - 1, height - 1), width * height);
+    
+    bench_check(memcmp(state->current->data, expected->data, width * height * 4) == 0 && state->distance == expected_distance,
+                what, TRIANGLE, width);
+    free_image(expected);
+}
+
+// Pruning repaints the damaged regions as it drops shapes, then the whole
+// canvas, and must leave the same canvas as a full render
+void check_prune(int width, int height, float threshold) {
+    Image* target = create_disc_image(width, height, width / 2);
+    State* state = init_state(target, compute_average_color(target), 1, 1, 1, 1, 1);
+    
+    for (int i = 0; i < 60; i++) {
+        add_shape_to_state(state, optimize_shape(state, find_best_shape(state, 50), 20));
+        check_candidate_pool(state, "pooled score after add_shape_to_state");
+    }
+    int removed = prune_shapes(state, threshold);
+    check_candidate_pool(state, "pooled score after prune_shapes");
+    
+    bench_check(removed > 0, "prune_shapes removes shapes", TRIANGLE, width);
+    check_full_render(state, "prune_shapes vs full render");
+    
+    free_state(state);
+    free_image(target);
+}
+
+// Moving the disc on the next frame must refit and drop shapes, rebuild the
+// canvas from the kept ones, and center new candidates on the changed tiles only
+void check_warm_start(int width, int height) {
+    Image* target = create_disc_image(width, height, width / 3);
+    Image* next = create_disc_image(width, height, width * 2 / 3);
+    State* state = init_state(target, compute_average_color(target), 1, 1, 1, 1, 1);
+    
+    for (int i = 0; i < 60; i++) {
+        add_shape_to_state(state, optimize_shape(state, find_best_shape(state, 50), 20));
+    }
+    Shape before[60];
+    int count = state->shape_count;
+    memcpy(before, state->shapes, count * sizeof(Shape));
+    int kept = warm_start_frame(state, next->data);
+    
+    // Kept shapes stay in order with their geometry; some get a new color
+    int recolored = 0;
+    for (int i = 0, j = 0; i < kept; i++, j++) {
+        while (j < count && memcmp(&before[j].data, &state->shapes[i].data, sizeof(before[j].data)) != 0) j++;
+        bench_check(j < count, "warm_start_frame keeps shape geometry", state->shapes[i].type, width);
+        if (j < count) recolored += memcmp(&before[j].color, &state->shapes[i].color, sizeof(Color)) != 0;
+    }
+    bench_check(kept > 0 && kept < count && recolored > 0, "warm_start_frame refits and drops shapes", TRIANGLE, width);
+    check_full_render(state, "warm_start_frame vs full render");
+    
+    int tile_count = state->tiles_x * state->tiles_y;
+    bench_check(state->focus_tile_count > 0 && state->focus_tile_count < tile_count, "warm_start_frame changed tiles", TRIANGLE, width);
+    for (int i = 0; i < 200; i++) {
+        Shape shape = new_candidate_shape(state);
+        int tile = (shape.bbox.top + shape.bbox.height / 2) / TILE_SIZE * state->tiles_x + (shape.bbox.left + shape.bbox.width / 2) / TILE_SIZE;
+        int anchored = 0;
+        for (int k = 0; k < state->focus_tile_count; k++) anchored |= state->focus_tiles[k] == tile;
+        bench_check(anchored, "new_candidate_shape centered on a changed tile", shape.type, width);
+    }
+    
+    free_state(state);
+    free_image(next);
+    free_image(target);
+}
+
+double bench_seconds(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+const char* shape_type_names[] = {"triangle", "rectangle", "ellipse", "rot-rect", "rot-ellip"};
+
+// Time each kernel on BENCH_SHAPES shapes of one type and size, in microseconds per shape
+void bench_kernels(Image* current, Image* target, ShapeType type, int size) {
+    static Shape shapes[BENCH_SHAPES];
+    int width = current->width;
+    int height = current->height;
+    Coverage coverage = {global_span_buffers[0], 0, -1};
+    volatile float sink = 0;
+    
+    srand(BENCH_SEED);
+    for (int i = 0; i < BENCH_SHAPES; i++) {
+        shapes[i] = create_sized_shape(type, width, height, size);
+    }
+    
+    clock_t start = clock();
+    for (int i = 0; i < BENCH_SHAPES; i++) render_shape_to_mask(width, height, shapes[i]);
+    double mask_time = bench_seconds(start);
+    
+    start = clock();
+    for (int i = 0; i < BENCH_SHAPES; i++) compute_shape_coverage(width, height, shapes[i], &coverage);
+    double coverage_time = bench_seconds(start);
+    
+    start = clock();
+    for (int i = 0; i < BENCH_SHAPES; i++) sink += compute_optimal_color(current, target, shapes[i]).r;
+    double color_time = bench_seconds(start);
+    
+    start = clock();
+    for (int i = 0; i < BENCH_SHAPES; i++) sink += compute_difference_change_direct(current, target, shapes[i], shapes[i].color);
+    double difference_time = bench_seconds(start);
+    
+    start = clock();
+    for (int i = 0; i < BENCH_SHAPES; i++) {
+        CoverageStats stats;
+        compute_shape_coverage(width, height, shapes[i], &coverage);
+        compute_coverage_stats(current, target, &coverage, &stats);
+        Color color = compute_color_from_stats(&stats, shapes[i].alpha);
+        sink += compute_difference_change_from_stats(&stats, color, shapes[i].alpha);
+    }
+    double stats_time = bench_seconds(start);
+    
+    Image* canvas = clone_image(current);
+    start = clock();
+    for (int i = 0; i < BENCH_SHAPES; i++) render_shape(canvas, shapes[i]);
+    double render_time = bench_seconds(start);
+    free_image(canvas);
+    
+    double scale = 1e6 / BENCH_SHAPES;
+    printf("%5d %-9s %5d %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", width,
+           shape_type_names[type], size,
+           mask_time * scale, coverage_time * scale, color_time * scale, difference_time * scale,
+           stats_time * scale, render_time * scale);
+}
+
+// Time finding the best of BENCH_SHAPES mixed candidates with bounded scoring,
+// one candidate at a time and in batches sharing their row sweeps
+void bench_batch(State* state, int size) {
+    static Shape shapes[BENCH_SHAPES];
+    static Candidate candidates[BENCH_SHAPES];
+    Coverage coverage = {global_span_buffers[0], 0, -1};
+    volatile float sink = 0;
+    
+    srand(BENCH_SEED);
+    for (int i = 0; i < BENCH_SHAPES; i++) {
+        shapes[i] = create_sized_shape(random_int(TRIANGLE, ROTATED_ELLIPSE), state->current->width, state->current->height, size);
+    }
+    
+    clock_t start = clock();
+    float best_difference = INFINITY;
+    for (int i = 0; i < BENCH_SHAPES; i++) {
+        best_difference = fmin(best_difference, score_candidate_bounded(state, &shapes[i], &coverage, best_difference));
+    }
+    double single_time = bench_seconds(start);
+    sink += best_difference;
+    
+    start = clock();
+    best_difference = INFINITY;
+    for (int i = 0; i < BENCH_SHAPES; i += CANDIDATE_BATCH) {
+        Candidate* batch[CANDIDATE_BATCH];
+        int count = fmin(CANDIDATE_BATCH, BENCH_SHAPES - i);
+        for (int k = 0; k < count; k++) {
+            candidates[i + k] = (Candidate){.shape = shapes[i + k], .score = -INFINITY};
+            batch[k] = &candidates[i + k];
+        }
+        int best = score_candidate_batch(state, batch, count, best_difference);
+        if (best >= 0) best_difference = batch[best]->score;
+    }
+    double batch_time = bench_seconds(start);
+    sink += best_difference;
+    
+    printf("best of %d candidates, size %4d: one at a time %7.2f ms, batched %7.2f ms\n",
+           BENCH_SHAPES, size, single_time * 1000, batch_time * 1000);
+}
+
+// Time the point tests over every pixel of a size x size box
+void bench_point_tests(int size) {
+    volatile int inside = 0;
+    
+    clock_t start = clock();
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) inside += point_in_triangle(x, y, 0, 0, size, size / 3, size / 4, size);
+    }
+    double triangle_time = bench_seconds(start);
+    
+    start = clock();
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) inside += point_in_ellipse(x, y, size / 2, size / 2, size / 2, size / 3);
+    }
+    double ellipse_time = bench_seconds(start);
+    
+    printf("point_in_triangle %.2f ns/px, point_in_ellipse %.2f ns/px\n",
+           triangle_time * 1e9 / ((double)size * size), ellipse_time * 1e9 / ((double)size * size));
+}
+
+int main() {
+    static const int image_sizes[] = {256, 1024};
+    static const int shape_sizes[] = {8, 64, 256};
+    
+    for (int s = 0; s < 2; s++) {
+        int width = image_sizes[s];
+        int height = image_sizes[s];
+        
+        srand(BENCH_SEED);
+        Image* target = create_random_image(width, height);
+        Image* current = create_random_image(width, height);
+        ensure_mask_buffer(width, height);
+        ensure_span_buffers(height);
+        
+        State* state = init_state(target, (Color){0, 0, 0, 255}, 1, 1, 1, 1, 1);
+        memcpy(state->current->data, current->data, width * height * 4);
+        BoundingBox full = {0, 0, width, height};
+        update_error_maps(state, full);
+        
+        // Differential checks
+        for (int type = TRIANGLE; type <= ROTATED_ELLIPSE; type++) {
+            for (int z = 0; z < 3; z++) {
+                for (int i = 0; i < 200; i++) {
+                    Shape shape = create_sized_shape(type, width, height, shape_sizes[z]);
+                    Shape other = create_sized_shape(type, width, height, shape_sizes[z]);
+                    check_shape(current, target, shape, i % 2 ? mutate_shape(shape, shape.alpha) : other, shape_sizes[z]);
+                    check_bounded_score(state, shape, shape_sizes[z]);
+                }
+            }
+        }
+        for (int z = 0; z < 3; z++) {
+            for (int i = 0; i < 50; i++) check_batch_score(state, shape_sizes[z]);
+        }
+        check_prune(width, height, 0.05f);
+        check_warm_start(width, height);
+        
+        // Tile errors must add up to the full-image error (the reference sums in
+        // float, so it drifts on large images)
+        float reference_distance = compute_distance(state->current, target);
+        bench_check(fabs(state->distance - reference_distance) <= 1e-3f * reference_distance, "tile errors vs compute_distance", TRIANGLE, width);
+        
+        // Kernel timings
+        printf("\n%5s %-9s %5s %10s %10s %10s %10s %10s %10s  (us per shape)\n", "image", "type", "size",
+               "mask", "coverage", "color", "diff", "stats", "render");
+        for (int type = TRIANGLE; type <= ROTATED_ELLIPSE; type++) {
+            for (int z = 0; z < 3; z++) {
+                bench_kernels(current, target, type, shape_sizes[z]);
+            }
+        }
+        
+        clock_t start = clock();
+        volatile float distance = 0;
+        for (int i = 0; i < 20; i++) distance += compute_distance(current, target);
+        printf("compute_distance %.2f ms per call\n", bench_seconds(start) * 1000 / 20);
+        
+        for (int z = 1; z < 3; z++) {
+            bench_batch(state, shape_sizes[z] * width / 256);
+        }
+        
+        free_state(state);
+        free_image(current);
+        free_image(target);
+        free_global_buffers();
+    }
+    
+    printf("\n");
+    bench_point_tests(1024);
+    
+    printf("%s: %d mismatches\n", bench_failures ? "FAILED" : "OK", bench_failures);
+    return bench_failures ? 1 : 0;
+}
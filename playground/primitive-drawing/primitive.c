@@ -1,20 +1,67 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
 
 // Constants
 #define MAX_SHAPES 1000
 #define MAX_CANDIDATES 500
 #define MAX_MUTATIONS 200
 
+// Side length of the tiles used to track per-region error
+#define TILE_SIZE 64
+
+// Pixels each region extends past its core in a partitioned run
+#define REGION_OVERLAP 16
+
+// Largest grid a partitioned run accepts (grid x grid regions)
+#define MAX_REGION_GRID 8
+
+// Mean squared change per channel above which a tile counts as changed between frames
+#define FRAME_CHANGE_THRESHOLD 64
+
+// Candidates scored together in one sweep over the rows they cover
+#define CANDIDATE_BATCH 256
+
+// Size of the first batch, scored on its own to set the bound for the rest
+#define BOUND_BATCH 16
+
+// Smallest fraction of the full extent new shapes are drawn with late in a run
+#define MIN_SHAPE_SCALE 0.1f
+
+// Share of the candidate pool carried into the next step; the rest is redrawn
+#define POOL_KEEP_FRACTION 0.5f
+
+// Shape pixels a prune pass may re-render, as a multiple of the image size
+#define PRUNE_WORK_PER_PIXEL 16
+
+// Upper bound on the SVG bytes written for one shape, used to size the output buffer
+#define SVG_BYTES_PER_SHAPE 256
+
+// Scratch buffers are per thread when regions are optimized concurrently
+#ifdef USE_THREADS
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL
+#endif
+
 // Shape types
 typedef enum {
     TRIANGLE = 0,
     RECTANGLE = 1,
-    ELLIPSE = 2
+    ELLIPSE = 2,
+    ROTATED_RECTANGLE = 3,
+    ROTATED_ELLIPSE = 4
 } ShapeType;
 
 // Structure definitions
@@ -36,6 +83,7 @@ typedef struct {
         struct { int x1, y1, x2, y2, x3, y3; } triangle;
         struct { int x1, y1, x2, y2; } rectangle;
         struct { int cx, cy, rx, ry; } ellipse;
+        struct { int cx, cy, rx, ry, angle; } rotated; // Half extents, angle in degrees
     } data;
     Color color;
     float alpha;
@@ -47,6 +95,53 @@ typedef struct {
     unsigned char* data; // RGBA data
 } Image;
 
+// Horizontal run of covered pixels [x0, x1] on one image row (empty when x0 > x1)
+typedef struct {
+    int x0;
+    int x1;
+} Span;
+
+// Per-row coverage of a shape; spans is indexed by image row, valid for top..bottom
+typedef struct {
+    Span* spans;
+    int top;
+    int bottom;
+} Coverage;
+
+// Integer sums over the covered pixels with d = target - current and u = current;
+// color and difference change follow from them in O(1)
+typedef struct {
+    long long sum_d[3];
+    long long sum_du[3];
+    long long sum_u[3];
+    long long sum_uu[3];
+    long long count;
+} CoverageStats;
+
+// Running sums along one row segment, as in CoverageStats (32 bits hold a full row)
+typedef struct {
+    int sum_d[3];
+    int sum_du[3];
+    int sum_u[3];
+    int sum_uu[3];
+} RowSums;
+
+// Scratch for one candidate of a scoring batch
+typedef struct {
+    Coverage coverage;
+    CoverageStats stats;
+    double remaining; // Largest possible improvement over the rows not yet scored
+} BatchEntry;
+
+// Candidate kept between steps. score is the exact difference change when
+// exact is set, otherwise a lower bound on it (-INFINITY until scored).
+typedef struct {
+    Shape shape;
+    float score;
+    int exact;
+    int cost; // Estimated covered pixels
+} Candidate;
+
 typedef struct {
     Image* target;
     Image* current;
@@ -54,15 +149,54 @@ typedef struct {
     int shape_count;
     Color background;
     float distance;
+    // Distance of the flat starting canvas; new shapes shrink as distance falls below it
+    float initial_distance;
+    // Squared error per TILE_SIZE x TILE_SIZE tile (row-major), so committing a
+    // shape only rescans the tiles it touches instead of the whole image
+    long long* tile_errors;
+    int tiles_x;
+    int tiles_y;
+    long long total_error;
+    // Per-row prefix sums of the squared error, (width + 1) entries per row; they
+    // bound how much any shape can still improve the rows it has left to score
+    unsigned int* row_residuals;
+    // Bounding box of the tiles whose target changed on the last frame (zero
+    // width = whole image); new shapes are sized for it
+    BoundingBox focus;
+    // Indices of those changed tiles; new shapes are centered in one of them
+    int* focus_tiles;
+    int focus_tile_count;
+    // Candidates carried across steps; a commit only invalidates the ones whose
+    // bbox overlaps the damaged region, the rest keep their scores
+    Candidate* pool;
+    int pool_size;
+    int pool_capacity;
     // Shape type settings
     int use_triangles;
     int use_rectangles;
     int use_ellipses;
+    int use_rotated_rectangles;
+    int use_rotated_ellipses;
 } State;
 
-// Global buffer for mask operations to avoid repeated allocations
-unsigned char* global_mask_buffer = NULL;
-int global_mask_buffer_size = 0;
+// Global buffer for mask operations to avoid repeated allocations (one byte per pixel)
+THREAD_LOCAL unsigned char* global_mask_buffer = NULL;
+THREAD_LOCAL int global_mask_buffer_size = 0;
+
+// Global span buffers used by the hill climber (current best and mutated coverage)
+THREAD_LOCAL Span* global_span_buffers[2] = {NULL, NULL};
+THREAD_LOCAL int global_span_buffer_rows = 0;
+
+// Coverage of each candidate in a scoring batch, CANDIDATE_BATCH blocks of rows
+THREAD_LOCAL Span* global_batch_spans = NULL;
+THREAD_LOCAL BatchEntry global_batch_entries[CANDIDATE_BATCH];
+
+// Prefix sums of the row segment a scoring batch shares, one entry per pixel plus one
+THREAD_LOCAL RowSums* global_row_sums = NULL;
+THREAD_LOCAL int global_row_sums_size = 0;
+
+// Upper bound on engine allocations for one optimizer, in bytes (0 = no limit)
+double memory_limit_bytes = 0;
 
 // Function prototypes
 int random_int(int min, int max);
@@ -77,33 +211,69 @@ void free_image(Image* img);
 void fill_image(Image* img, Color color);
 Image* clone_image(Image* source);
 float compute_distance(Image* img1, Image* img2);
+long long compute_region_error(Image* img1, Image* img2, int left, int top, int right, int bottom);
 
 // Shape operations
 Shape create_random_shape(int width, int height, float alpha, State* state);
+float shape_extent_scale(State* state);
+int estimate_shape_cost(Shape shape, int width, int height);
 Shape mutate_shape(Shape shape, float alpha);
+Shape offset_shape(Shape shape, int dx, int dy);
+void update_rotated_bbox(Shape* shape);
 void render_shape(Image* img, Shape shape);
 void render_shape_to_mask(int width, int height, Shape shape);
 Color compute_optimal_color(Image* current, Image* target, Shape shape);
 float compute_difference_change_direct(Image* current, Image* target, Shape shape, Color color);
 
+// Span coverage operations
+void compute_shape_coverage(int width, int height, Shape shape, Coverage* coverage);
+void compute_rotated_span(Shape* shape, float c, float s, int y, Span* span);
+void compute_coverage_stats(Image* current, Image* target, Coverage* coverage, CoverageStats* stats);
+void update_coverage_stats(Image* current, Image* target, Coverage* old_coverage, Coverage* new_coverage, CoverageStats* stats);
+Color compute_color_from_stats(CoverageStats* stats, float alpha);
+float compute_difference_change_from_stats(CoverageStats* stats, Color color, float alpha);
+int score_candidate_batch(State* state, Candidate** batch, int count, float bound);
+
 // State operations
-State* init_state(Image* target, Color background, int use_triangles, int use_rectangles, int use_ellipses);
+Color compute_average_color(Image* target);
+State* init_state(Image* target, Color background, int use_triangles, int use_rectangles, int use_ellipses, int use_rotated_rectangles, int use_rotated_ellipses);
 void free_state(State* state);
 void add_shape_to_state(State* state, Shape shape);
+void update_error_maps(State* state, BoundingBox bbox);
+void invalidate_candidate_pool(State* state, BoundingBox bbox);
+int boxes_intersect(BoundingBox a, BoundingBox b);
+double estimate_optimizer_memory(int width, int height);
+char* write_svg(State* state, int out_width, int out_height, int pretty);
 void export_svg(State* state, const char* filename);
 
 // Optimizer
+Shape new_candidate_shape(State* state);
 Shape find_best_shape(State* state, int candidates);
 Shape optimize_shape(State* state, Shape shape, int mutations);
 void run_optimizer(State* state, int steps, int candidates, int mutations);
+int run_partitioned_optimizer(State* state, int grid, int steps, int candidates, int mutations);
+int warm_start_frame(State* state, unsigned char* target_data);
+int prune_shapes(State* state, float threshold);
 
 // WebAssembly exports
 EMSCRIPTEN_KEEPALIVE
-void* create_optimizer(int width, int height, unsigned char* target_data, int bg_r, int bg_g, int bg_b, int use_triangles, int use_rectangles, int use_ellipses);
+void* create_optimizer(int width, int height, unsigned char* target_data, int bg_r, int bg_g, int bg_b, int use_triangles, int use_rectangles, int use_ellipses, int use_rotated_rectangles, int use_rotated_ellipses);
 
 EMSCRIPTEN_KEEPALIVE
 void run_optimization(void* state_ptr, int steps, int candidates, int mutations);
 
+EMSCRIPTEN_KEEPALIVE
+int run_partitioned_optimization(void* state_ptr, int grid, int steps, int candidates, int mutations);
+
+EMSCRIPTEN_KEEPALIVE
+int load_next_frame(void* state_ptr, unsigned char* target_data);
+
+EMSCRIPTEN_KEEPALIVE
+int get_shape_count(void* state_ptr);
+
+EMSCRIPTEN_KEEPALIVE
+int prune_optimizer_shapes(void* state_ptr, float threshold);
+
 EMSCRIPTEN_KEEPALIVE
 unsigned char* get_current_image(void* state_ptr);
 
@@ -113,9 +283,15 @@ float get_current_similarity(void* state_ptr);
 EMSCRIPTEN_KEEPALIVE
 char* export_svg_string(void* state_ptr);
 
+EMSCRIPTEN_KEEPALIVE
+char* export_svg_scaled(void* state_ptr, int out_width, int out_height, int pretty);
+
 EMSCRIPTEN_KEEPALIVE
 void free_optimizer(void* state_ptr);
 
+EMSCRIPTEN_KEEPALIVE
+void set_memory_limit(double bytes);
+
 // Implementation of core functionality
 int random_int(int min, int max) {
     return min + rand() % (max - min + 1);
@@ -139,16 +315,74 @@ void init_random() {
     srand(time(NULL));
 }
 
-// Initialize or resize the global mask buffer
-void ensure_mask_buffer(int width, int height) {
-    int required_size = width * height * 4;
+// Initialize or resize the global mask buffer. Returns 0 if allocation failed.
+int ensure_mask_buffer(int width, int height) {
+    int required_size = width * height;
     if (global_mask_buffer == NULL || global_mask_buffer_size < required_size) {
         if (global_mask_buffer) {
             free(global_mask_buffer);
         }
         global_mask_buffer = (unsigned char*)calloc(required_size, sizeof(unsigned char));
-        global_mask_buffer_size = required_size;
+        global_mask_buffer_size = global_mask_buffer ? required_size : 0;
+    }
+    return global_mask_buffer != NULL;
+}
+
+// Initialize or resize the row prefix sums used by batched scoring. Returns 0
+// if allocation failed.
+int ensure_row_sums(int width) {
+    if (global_row_sums == NULL || global_row_sums_size < width + 1) {
+        free(global_row_sums);
+        global_row_sums = (RowSums*)malloc((width + 1) * sizeof(RowSums));
+        global_row_sums_size = global_row_sums ? width + 1 : 0;
+    }
+    return global_row_sums != NULL;
+}
+
+// Initialize or resize the global span buffers (one span per image row).
+// Returns 0 if allocation failed, leaving all of them unallocated.
+int ensure_span_buffers(int height) {
+    if (global_span_buffers[0] == NULL || global_span_buffer_rows < height) {
+        for (int i = 0; i < 2; i++) {
+            free(global_span_buffers[i]);
+            global_span_buffers[i] = (Span*)malloc(height * sizeof(Span));
+        }
+        free(global_batch_spans);
+        global_batch_spans = (Span*)malloc((size_t)CANDIDATE_BATCH * height * sizeof(Span));
+        global_span_buffer_rows = height;
+        
+        if (!global_span_buffers[0] || !global_span_buffers[1] || !global_batch_spans) {
+            for (int i = 0; i < 2; i++) {
+                free(global_span_buffers[i]);
+                global_span_buffers[i] = NULL;
+            }
+            free(global_batch_spans);
+            global_batch_spans = NULL;
+            global_span_buffer_rows = 0;
+        }
+    }
+    return global_span_buffers[0] != NULL;
+}
+
+// Release the calling thread's mask and span buffers
+void free_global_buffers() {
+    if (global_mask_buffer) {
+        free(global_mask_buffer);
+        global_mask_buffer = NULL;
+        global_mask_buffer_size = 0;
+    }
+    
+    for (int i = 0; i < 2; i++) {
+        free(global_span_buffers[i]);
+        global_span_buffers[i] = NULL;
     }
+    free(global_batch_spans);
+    global_batch_spans = NULL;
+    global_span_buffer_rows = 0;
+    
+    free(global_row_sums);
+    global_row_sums = NULL;
+    global_row_sums_size = 0;
 }
 
 // Clear the mask buffer within a specific bounding box - FIXED
@@ -162,12 +396,13 @@ void clear_mask_region(int width, int height, BoundingBox bbox) {
     
     for (int y = top; y <= bottom; y++) {
         // Start at the correct left position, not at the beginning of the row
-        memset(&global_mask_buffer[(y * width + left) * 4], 0, (right - left + 1) * 4);
+        memset(&global_mask_buffer[y * width + left], 0, right - left + 1);
     }
 }
 
 Image* create_image(int width, int height) {
     Image* img = (Image*)malloc(sizeof(Image));
+    if (!img) return NULL;
     img->width = width;
     img->height = height;
     img->data = (unsigned char*)calloc(width * height * 4, sizeof(unsigned char));
@@ -214,10 +449,34 @@ float compute_distance(Image* img1, Image* img2) {
     return sqrt(sum / (3.0f * 255.0f * 255.0f * pixels));
 }
 
+// Sum of squared RGB differences over the inclusive region
+long long compute_region_error(Image* img1, Image* img2, int left, int top, int right, int bottom) {
+    long long sum = 0;
+    
+    for (int y = top; y <= bottom; y++) {
+        int idx = (y * img1->width + left) * 4;
+        for (int x = left; x <= right; x++) {
+            int dr = img1->data[idx] - img2->data[idx];
+            int dg = img1->data[idx + 1] - img2->data[idx + 1];
+            int db = img1->data[idx + 2] - img2->data[idx + 2];
+            sum += dr * dr + dg * dg + db * db;
+            idx += 4;
+        }
+    }
+    
+    return sum;
+}
+
+// Same normalization as compute_distance, from a total squared error
+float distance_from_error(long long total_error, int pixels) {
+    return sqrt(total_error / (3.0 * 255.0 * 255.0 * pixels));
+}
+
 // Helper function to determine available shape types based on user selection
 ShapeType select_random_shape_type(State* state) {
     // Count how many types are enabled
-    int enabled_types = state->use_triangles + state->use_rectangles + state->use_ellipses;
+    int enabled_types = state->use_triangles + state->use_rectangles + state->use_ellipses +
+                        state->use_rotated_rectangles + state->use_rotated_ellipses;
     
     // If none are enabled, default to all shapes
     if (enabled_types == 0) {
@@ -245,16 +504,75 @@ ShapeType select_random_shape_type(State* state) {
     
     if (state->use_ellipses) {
         if (current == index) return ELLIPSE;
+        current++;
+    }
+    
+    if (state->use_rotated_rectangles) {
+        if (current == index) return ROTATED_RECTANGLE;
+        current++;
+    }
+    
+    if (state->use_rotated_ellipses) {
+        if (current == index) return ROTATED_ELLIPSE;
     }
     
     // Default to triangle (should never get here)
     return TRIANGLE;
 }
 
+// Fraction of the full extent new shapes are drawn with, shrinking with the distance
+float shape_extent_scale(State* state) {
+    if (state->initial_distance <= 0) return 1.0f;
+    return clamp(state->distance / state->initial_distance, MIN_SHAPE_SCALE, 1.0f);
+}
+
+// Pixels a shape is expected to cover, which is what scoring it costs: its
+// area, scaled by the share of its bbox that lies inside the image
+int estimate_shape_cost(Shape shape, int width, int height) {
+    double area = 0;
+    switch(shape.type) {
+        case TRIANGLE:
+            area = fabs((double)(shape.data.triangle.x2 - shape.data.triangle.x1) * (shape.data.triangle.y3 - shape.data.triangle.y1) -
+                        (double)(shape.data.triangle.x3 - shape.data.triangle.x1) * (shape.data.triangle.y2 - shape.data.triangle.y1)) / 2;
+            break;
+        case RECTANGLE:
+            area = (double)shape.bbox.width * shape.bbox.height;
+            break;
+        case ELLIPSE:
+            area = M_PI * shape.data.ellipse.rx * shape.data.ellipse.ry;
+            break;
+        case ROTATED_RECTANGLE:
+            area = 4.0 * shape.data.rotated.rx * shape.data.rotated.ry;
+            break;
+        case ROTATED_ELLIPSE:
+            area = M_PI * shape.data.rotated.rx * shape.data.rotated.ry;
+            break;
+    }
+    
+    int left = fmax(0, shape.bbox.left);
+    int top = fmax(0, shape.bbox.top);
+    int right = fmin(width, shape.bbox.left + shape.bbox.width);
+    int bottom = fmin(height, shape.bbox.top + shape.bbox.height);
+    if (right <= left || bottom <= top) return 0;
+    
+    double inside = (double)(right - left) * (bottom - top) / ((double)shape.bbox.width * shape.bbox.height);
+    return (int)(area * inside) + 1;
+}
+
+// Uniform integer within extent of center, limited to [0, limit - 1]
+int random_near(int center, int extent, int limit) {
+    return random_int(fmax(0, center - extent), fmin(limit - 1, center + extent));
+}
+
 Shape create_random_shape(int width, int height, float alpha, State* state) {
     Shape shape;
     shape.alpha = alpha;
     
+    // Largest extent for this stage of the run
+    float scale = shape_extent_scale(state);
+    int extent_x = fmax(2, width * scale);
+    int extent_y = fmax(2, height * scale);
+    
     // Select a random shape type from enabled types
     shape.type = select_random_shape_type(state);
     
@@ -268,10 +586,10 @@ Shape create_random_shape(int width, int height, float alpha, State* state) {
         case TRIANGLE:
             shape.data.triangle.x1 = random_int(0, width - 1);
             shape.data.triangle.y1 = random_int(0, height - 1);
-            shape.data.triangle.x2 = random_int(0, width - 1);
-            shape.data.triangle.y2 = random_int(0, height - 1);
-            shape.data.triangle.x3 = random_int(0, width - 1);
-            shape.data.triangle.y3 = random_int(0, height - 1);
+            shape.data.triangle.x2 = random_near(shape.data.triangle.x1, extent_x, width);
+            shape.data.triangle.y2 = random_near(shape.data.triangle.y1, extent_y, height);
+            shape.data.triangle.x3 = random_near(shape.data.triangle.x1, extent_x, width);
+            shape.data.triangle.y3 = random_near(shape.data.triangle.y1, extent_y, height);
             
             // Compute bounding box
             int min_x = fmin(shape.data.triangle.x1, fmin(shape.data.triangle.x2, shape.data.triangle.x3));
@@ -289,8 +607,8 @@ Shape create_random_shape(int width, int height, float alpha, State* state) {
             {
                 int x1 = random_int(0, width - 1);
                 int y1 = random_int(0, height - 1);
-                int x2 = random_int(0, width - 1);
-                int y2 = random_int(0, height - 1);
+                int x2 = random_near(x1, extent_x, width);
+                int y2 = random_near(y1, extent_y, height);
                 
                 shape.data.rectangle.x1 = fmin(x1, x2);
                 shape.data.rectangle.y1 = fmin(y1, y2);
@@ -307,14 +625,24 @@ Shape create_random_shape(int width, int height, float alpha, State* state) {
         case ELLIPSE:
             shape.data.ellipse.cx = random_int(0, width - 1);
             shape.data.ellipse.cy = random_int(0, height - 1);
-            shape.data.ellipse.rx = random_int(1, width / 4);
-            shape.data.ellipse.ry = random_int(1, height / 4);
+            shape.data.ellipse.rx = random_int(1, fmax(1, extent_x / 4));
+            shape.data.ellipse.ry = random_int(1, fmax(1, extent_y / 4));
             
             shape.bbox.left = shape.data.ellipse.cx - shape.data.ellipse.rx;
             shape.bbox.top = shape.data.ellipse.cy - shape.data.ellipse.ry;
             shape.bbox.width = 2 * shape.data.ellipse.rx;
             shape.bbox.height = 2 * shape.data.ellipse.ry;
             break;
+            
+        case ROTATED_RECTANGLE:
+        case ROTATED_ELLIPSE:
+            shape.data.rotated.cx = random_int(0, width - 1);
+            shape.data.rotated.cy = random_int(0, height - 1);
+            shape.data.rotated.rx = random_int(1, fmax(1, extent_x / 4));
+            shape.data.rotated.ry = random_int(1, fmax(1, extent_y / 4));
+            shape.data.rotated.angle = random_int(0, 179);
+            update_rotated_bbox(&shape);
+            break;
     }
     
     return shape;
@@ -341,6 +669,63 @@ int point_in_ellipse(int x, int y, int cx, int cy, int rx, int ry) {
     return (dx * dx + dy * dy) <= 1.0f;
 }
 
+// Cosine and sine of a rotated shape's angle, shared by every rotated-shape path
+void rotation_of(int angle, float* c, float* s) {
+    float radians = angle * (float)M_PI / 180.0f;
+    *c = cosf(radians);
+    *s = sinf(radians);
+}
+
+// Point test for a rectangle with half extents rx, ry rotated about (cx, cy);
+// c and s are the rotation from rotation_of, computed once per shape
+int point_in_rotated_rectangle(int x, int y, int cx, int cy, int rx, int ry, float c, float s) {
+    float u = (x - cx) * c + (y - cy) * s;
+    float v = -(x - cx) * s + (y - cy) * c;
+    return fabsf(u) <= rx && fabsf(v) <= ry;
+}
+
+// Point test for an ellipse with radii rx, ry rotated about (cx, cy)
+int point_in_rotated_ellipse(int x, int y, int cx, int cy, int rx, int ry, float c, float s) {
+    if (rx <= 0 || ry <= 0) return 0;
+    
+    float u = ((x - cx) * c + (y - cy) * s) / rx;
+    float v = (-(x - cx) * s + (y - cy) * c) / ry;
+    return (u * u + v * v) <= 1.0f;
+}
+
+int point_in_rotated_shape(Shape* shape, float c, float s, int x, int y) {
+    if (shape->type == ROTATED_RECTANGLE) {
+        return point_in_rotated_rectangle(x, y, shape->data.rotated.cx, shape->data.rotated.cy,
+                                          shape->data.rotated.rx, shape->data.rotated.ry, c, s);
+    }
+    return point_in_rotated_ellipse(x, y, shape->data.rotated.cx, shape->data.rotated.cy,
+                                    shape->data.rotated.rx, shape->data.rotated.ry, c, s);
+}
+
+// Bounding box of a rotated rectangle or ellipse from its extents and angle
+void update_rotated_bbox(Shape* shape) {
+    float c, s;
+    rotation_of(shape->data.rotated.angle, &c, &s);
+    float rx = shape->data.rotated.rx;
+    float ry = shape->data.rotated.ry;
+    float ex, ey;
+    
+    if (shape->type == ROTATED_RECTANGLE) {
+        ex = fabsf(c) * rx + fabsf(s) * ry;
+        ey = fabsf(s) * rx + fabsf(c) * ry;
+    } else {
+        ex = sqrtf(rx * rx * c * c + ry * ry * s * s);
+        ey = sqrtf(rx * rx * s * s + ry * ry * c * c);
+    }
+    
+    int half_width = (int)ceilf(ex);
+    int half_height = (int)ceilf(ey);
+    shape->bbox.left = shape->data.rotated.cx - half_width;
+    shape->bbox.top = shape->data.rotated.cy - half_height;
+    shape->bbox.width = 2 * half_width + 1;
+    shape->bbox.height = 2 * half_height + 1;
+}
+
 void render_shape(Image* img, Shape shape) {
     int x, y;
     int left = fmax(0, shape.bbox.left);
@@ -370,7 +755,29 @@ void render_shape(Image* img, Shape shape) {
         return;
     }
     
-    // For triangle and ellipse, test each pixel
+    // Rotated shapes blend the rows of their span coverage
+    if (shape.type == ROTATED_RECTANGLE || shape.type == ROTATED_ELLIPSE) {
+        float c, s;
+        rotation_of(shape.data.rotated.angle, &c, &s);
+        for (y = top; y <= bottom; y++) {
+            Span span = {left, right};
+            compute_rotated_span(&shape, c, s, y, &span);
+            
+            int idx = (y * img->width + span.x0) * 4;
+            for (x = span.x0; x <= span.x1; x++) {
+                float src_a = shape.alpha;
+                float dst_a = 1.0f - src_a;
+                
+                img->data[idx] = clamp_color(shape.color.r * src_a + img->data[idx] * dst_a);
+                img->data[idx + 1] = clamp_color(shape.color.g * src_a + img->data[idx + 1] * dst_a);
+                img->data[idx + 2] = clamp_color(shape.color.b * src_a + img->data[idx + 2] * dst_a);
+                idx += 4;
+            }
+        }
+        return;
+    }
+    
+    // For the other shapes, test each pixel
     for (y = top; y <= bottom; y++) {
         for (x = left; x <= right; x++) {
             int inside = 0;
@@ -394,7 +801,9 @@ void render_shape(Image* img, Shape shape) {
                     break;
                     
                 case RECTANGLE:
-                    // This is already handled more efficiently above
+                case ROTATED_RECTANGLE:
+                case ROTATED_ELLIPSE:
+                    // These are already handled more efficiently above
                     break;
             }
             
@@ -430,9 +839,20 @@ void render_shape_to_mask(int width, int height, Shape shape) {
     // Fast path for rectangles
     if (shape.type == RECTANGLE) {
         for (y = top; y <= bottom; y++) {
-            for (x = left; x <= right; x++) {
-                int idx = (y * width + x) * 4;
-                global_mask_buffer[idx + 3] = 255; // Full alpha
+            memset(&global_mask_buffer[y * width + left], 255, right - left + 1);
+        }
+        return;
+    }
+    
+    // Rotated shapes fill the rows of their span coverage
+    if (shape.type == ROTATED_RECTANGLE || shape.type == ROTATED_ELLIPSE) {
+        float c, s;
+        rotation_of(shape.data.rotated.angle, &c, &s);
+        for (y = top; y <= bottom; y++) {
+            Span span = {left, right};
+            compute_rotated_span(&shape, c, s, y, &span);
+            if (span.x0 <= span.x1) {
+                memset(&global_mask_buffer[y * width + span.x0], 255, span.x1 - span.x0 + 1);
             }
         }
         return;
@@ -462,13 +882,14 @@ void render_shape_to_mask(int width, int height, Shape shape) {
                     break;
                     
                 case RECTANGLE:
+                case ROTATED_RECTANGLE:
+                case ROTATED_ELLIPSE:
                     // Already handled above
                     break;
             }
             
             if (inside) {
-                int idx = (y * width + x) * 4;
-                global_mask_buffer[idx + 3] = 255; // Set alpha to indicate "inside"
+                global_mask_buffer[y * width + x] = 255; // Mark as "inside"
             }
         }
     }
@@ -575,6 +996,32 @@ Shape mutate_shape(Shape shape, float alpha) {
                 mutated.bbox.height = 2 * mutated.data.ellipse.ry;
             }
             break;
+            
+        case ROTATED_RECTANGLE:
+        case ROTATED_ELLIPSE:
+            {
+                // Choose what to mutate
+                int mutation_type = random_int(0, 3);
+                
+                if (mutation_type == 0) { // Move center
+                    angle = random_float() * 2 * M_PI;
+                    radius = random_float() * 20;
+                    mutated.data.rotated.cx += (int)(radius * cos(angle));
+                    mutated.data.rotated.cy += (int)(radius * sin(angle));
+                } else if (mutation_type == 1) { // Change rx
+                    amount = (int)((random_float() - 0.5) * 20);
+                    mutated.data.rotated.rx = fmax(1, mutated.data.rotated.rx + amount);
+                } else if (mutation_type == 2) { // Change ry
+                    amount = (int)((random_float() - 0.5) * 20);
+                    mutated.data.rotated.ry = fmax(1, mutated.data.rotated.ry + amount);
+                } else { // Rotate by up to 15 degrees either way
+                    amount = random_int(-15, 15);
+                    mutated.data.rotated.angle = ((mutated.data.rotated.angle + amount) % 180 + 180) % 180;
+                }
+                
+                update_rotated_bbox(&mutated);
+            }
+            break;
     }
     
     // Sometimes mutate alpha
@@ -589,7 +1036,7 @@ Shape mutate_shape(Shape shape, float alpha) {
 // Rewritten to match the JS computeColor function more closely
 Color compute_optimal_color(Image* current, Image* target, Shape shape) {
     // Initialize global mask buffer if needed
-    ensure_mask_buffer(current->width, current->height);
+    if (!ensure_mask_buffer(current->width, current->height)) return shape.color;
     
     // Render shape to mask
     render_shape_to_mask(current->width, current->height, shape);
@@ -612,7 +1059,7 @@ Color compute_optimal_color(Image* current, Image* target, Shape shape) {
             int idx = (y * current->width + x) * 4;
             
             // Only where mask indicates shape presence
-            if (global_mask_buffer[idx + 3] > 0) {
+            if (global_mask_buffer[y * current->width + x] > 0) {
                 // Exact JS formula: color += (target - current) / alpha + current
                 r_sum += (target->data[idx] - current->data[idx]) / shape.alpha + current->data[idx];
                 g_sum += (target->data[idx + 1] - current->data[idx + 1]) / shape.alpha + current->data[idx + 1];
@@ -636,7 +1083,7 @@ Color compute_optimal_color(Image* current, Image* target, Shape shape) {
 // Direct difference calculation without creating temporary images - FIXED
 float compute_difference_change_direct(Image* current, Image* target, Shape shape, Color color) {
     // Initialize global mask buffer if needed
-    ensure_mask_buffer(current->width, current->height);
+    if (!ensure_mask_buffer(current->width, current->height)) return INFINITY;
     
     // Render shape to mask
     render_shape_to_mask(current->width, current->height, shape);
@@ -658,7 +1105,7 @@ float compute_difference_change_direct(Image* current, Image* target, Shape shap
             int idx = (y * current->width + x) * 4;
             
             // Only where mask indicates shape presence
-            if (global_mask_buffer[idx + 3] > 0) {
+            if (global_mask_buffer[y * current->width + x] > 0) {
                 float a = shape.alpha;
                 float b = 1.0f - a;
                 
@@ -683,142 +1130,874 @@ float compute_difference_change_direct(Image* current, Image* target, Shape shap
     return sum;
 }
 
-State* init_state(Image* target, Color background, int use_triangles, int use_rectangles, int use_ellipses) {
-    // Compute average color of the target image
-    float r_sum = 0, g_sum = 0, b_sum = 0;
-    int total_pixels = target->width * target->height;
-    
-    for (int i = 0; i < total_pixels; i++) {
-        r_sum += target->data[i * 4];
-        g_sum += target->data[i * 4 + 1];
-        b_sum += target->data[i * 4 + 2];
-    }
-    
-    Color average_color = {
-        .r = (unsigned char)(r_sum / total_pixels),
-        .g = (unsigned char)(g_sum / total_pixels),
-        .b = (unsigned char)(b_sum / total_pixels),
-        .a = 255
-    };
-
-    State* state = (State*)malloc(sizeof(State));
-    state->target = target;
-    state->current = create_image(target->width, target->height);
-    
-    // Use computed average color instead of the passed background
-    fill_image(state->current, average_color);
-    state->background = average_color;
-    
-    state->shapes = (Shape*)malloc(MAX_SHAPES * sizeof(Shape));
-    state->shape_count = 0;
-    state->distance = compute_distance(state->current, target);
-    
-    // Store shape type settings
-    state->use_triangles = use_triangles;
-    state->use_rectangles = use_rectangles;
-    state->use_ellipses = use_ellipses;
-    
-    // Initialize the global mask buffer
-    ensure_mask_buffer(target->width, target->height);
-    
-    return state;
+// Floor division that rounds toward negative infinity
+int floor_div(int a, int b) {
+    int q = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) q--;
+    return q;
 }
 
-void free_state(State* state) {
-    if (state) {
-        free_image(state->current);
-        free(state->shapes);
-        free(state);
+// Restrict [*lo, *hi] to the x values where a * x + b >= 0
+void clip_span_to_half_plane(int a, int b, int* lo, int* hi) {
+    if (a > 0) {
+        int min_x = -floor_div(b, a); // ceil(-b / a)
+        if (min_x > *lo) *lo = min_x;
+    } else if (a < 0) {
+        int max_x = floor_div(b, -a); // floor(-b / a)
+        if (max_x < *hi) *hi = max_x;
+    } else if (b < 0) {
+        *hi = *lo - 1;
     }
 }
 
-void add_shape_to_state(State* state, Shape shape) {
-    if (state->shape_count < MAX_SHAPES) {
-        state->shapes[state->shape_count++] = shape;
-        render_shape(state->current, shape);
-        state->distance = compute_distance(state->current, state->target);
+// Narrow [*lo, *hi] to the x where -r <= a * x + b <= r
+void clip_span_to_slab(float a, float b, float r, float* lo, float* hi) {
+    if (fabsf(a) < 1e-6f) {
+        if (fabsf(b) > r) *hi = *lo - 1;
+        return;
     }
+    
+    float x1 = (-r - b) / a;
+    float x2 = (r - b) / a;
+    *lo = fmaxf(*lo, fminf(x1, x2));
+    *hi = fminf(*hi, fmaxf(x1, x2));
 }
 
-void export_svg(State* state, const char* filename) {
-    FILE* file = fopen(filename, "w");
-    if (!file) return;
+// Narrow span to a rotated shape's coverage on row y; the ends are settled with
+// the exact point test so every rasterizer covers the same pixels
+void compute_rotated_span(Shape* shape, float c, float s, int y, Span* span) {
+    int cx = shape->data.rotated.cx;
+    int rx = shape->data.rotated.rx;
+    int ry = shape->data.rotated.ry;
+    float dy = y - shape->data.rotated.cy;
+    
+    // Offsets from cx along the row
+    float lo = span->x0 - cx - 1;
+    float hi = span->x1 - cx + 1;
+    
+    if (shape->type == ROTATED_RECTANGLE) {
+        clip_span_to_slab(c, dy * s, rx, &lo, &hi);
+        clip_span_to_slab(-s, dy * c, ry, &lo, &hi);
+    } else if (rx > 0 && ry > 0) {
+        // (u / rx)^2 + (v / ry)^2 <= 1 is a quadratic qa x^2 + qb x + qc <= 0
+        float qa = c * c / (rx * rx) + s * s / (ry * ry);
+        float qb = 2 * dy * c * s * (1.0f / (rx * rx) - 1.0f / (ry * ry));
+        float qc = dy * dy * (s * s / (rx * rx) + c * c / (ry * ry)) - 1;
+        float disc = qb * qb - 4 * qa * qc;
+        float mid = -qb / (2 * qa);
+        float half = disc > 0 ? sqrtf(disc) / (2 * qa) : 0;
+        lo = fmaxf(lo, mid - half);
+        hi = fminf(hi, mid + half);
+    }
     
-    int width = state->current->width;
-    int height = state->current->height;
+    int x0 = cx + (int)ceilf(lo);
+    int x1 = cx + (int)floorf(hi);
     
-    // SVG header
-    fprintf(file, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\">\n", 
-            width, height, width, height);
+    // An empty estimate may still be one pixel wide near the tips
+    if (x0 > x1) {
+        x0 = x1 = cx + (int)lroundf((lo + hi) / 2);
+        if (!point_in_rotated_shape(shape, c, s, x0, y)) {
+            span->x1 = span->x0 - 1;
+            return;
+        }
+    }
     
-    // Background
-    fprintf(file, "  <rect width=\"100%%\" height=\"100%%\" fill=\"rgb(%d,%d,%d)\" />\n", 
-            state->background.r, state->background.g, state->background.b);
+    while (x0 - 1 >= span->x0 && point_in_rotated_shape(shape, c, s, x0 - 1, y)) x0--;
+    while (x0 <= x1 && !point_in_rotated_shape(shape, c, s, x0, y)) x0++;
+    while (x1 + 1 <= span->x1 && point_in_rotated_shape(shape, c, s, x1 + 1, y)) x1++;
+    while (x1 >= x0 && !point_in_rotated_shape(shape, c, s, x1, y)) x1--;
     
-    // Shapes
-    for (int i = 0; i < state->shape_count; i++) {
-        Shape shape = state->shapes[i];
-        Color color = shape.color;
-        
-        fprintf(file, "  ");
+    span->x0 = fmax(span->x0, x0);
+    span->x1 = fmin(span->x1, x1);
+}
+
+// Compute the covered span on each row of the shape's clipped bounding box,
+// matching the pixels render_shape_to_mask marks
+void compute_shape_coverage(int width, int height, Shape shape, Coverage* coverage) {
+    int left = fmax(0, shape.bbox.left);
+    int top = fmax(0, shape.bbox.top);
+    int right = fmin(width - 1, shape.bbox.left + shape.bbox.width - 1);
+    int bottom = fmin(height - 1, shape.bbox.top + shape.bbox.height - 1);
+    
+    coverage->top = top;
+    coverage->bottom = bottom;
+    if (left > right || top > bottom) {
+        coverage->bottom = top - 1;
+        return;
+    }
+    
+    float c = 0, s = 0;
+    if (shape.type == ROTATED_RECTANGLE || shape.type == ROTATED_ELLIPSE) {
+        rotation_of(shape.data.rotated.angle, &c, &s);
+    }
+    
+    for (int y = top; y <= bottom; y++) {
+        Span* span = &coverage->spans[y];
+        span->x0 = left;
+        span->x1 = right;
         
         switch(shape.type) {
             case TRIANGLE:
-                fprintf(file, "<polygon points=\"%d,%d %d,%d %d,%d\" ", 
-                        shape.data.triangle.x1, shape.data.triangle.y1,
-                        shape.data.triangle.x2, shape.data.triangle.y2,
-                        shape.data.triangle.x3, shape.data.triangle.y3);
+                {
+                    int xs[3] = {shape.data.triangle.x1, shape.data.triangle.x2, shape.data.triangle.x3};
+                    int ys[3] = {shape.data.triangle.y1, shape.data.triangle.y2, shape.data.triangle.y3};
+                    
+                    // Each edge function is linear in x along the row (a * x + b);
+                    // inside means all non-negative or all non-positive
+                    int pos_lo = left, pos_hi = right;
+                    int neg_lo = left, neg_hi = right;
+                    for (int e = 0; e < 3; e++) {
+                        int n = (e + 1) % 3;
+                        int a = ys[n] - ys[e];
+                        int b = -xs[e] * a - (xs[n] - xs[e]) * (y - ys[e]);
+                        clip_span_to_half_plane(a, b, &pos_lo, &pos_hi);
+                        clip_span_to_half_plane(-a, -b, &neg_lo, &neg_hi);
+                    }
+                    
+                    // Only one orientation is non-empty unless the triangle is
+                    // degenerate, in which case both cover the same pixels
+                    if (pos_lo > pos_hi) {
+                        span->x0 = neg_lo;
+                        span->x1 = neg_hi;
+                    } else if (neg_lo > neg_hi) {
+                        span->x0 = pos_lo;
+                        span->x1 = pos_hi;
+                    } else {
+                        span->x0 = fmin(pos_lo, neg_lo);
+                        span->x1 = fmax(pos_hi, neg_hi);
+                    }
+                }
                 break;
                 
-            case RECTANGLE:
-                fprintf(file, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" ",
-                        shape.data.rectangle.x1, shape.data.rectangle.y1,
-                        shape.data.rectangle.x2 - shape.data.rectangle.x1,
-                        shape.data.rectangle.y2 - shape.data.rectangle.y1);
+            case ELLIPSE:
+                {
+                    int cx = shape.data.ellipse.cx;
+                    int cy = shape.data.ellipse.cy;
+                    int rx = shape.data.ellipse.rx;
+                    int ry = shape.data.ellipse.ry;
+                    if (rx <= 0 || ry <= 0) {
+                        span->x1 = left - 1;
+                        break;
+                    }
+                    
+                    // Estimate the half width, then settle it with the exact pixel test
+                    float dy = (float)(y - cy) / ry;
+                    float rem = 1.0f - dy * dy;
+                    int half = rem > 0 ? (int)(rx * sqrtf(rem)) : 0;
+                    while (point_in_ellipse(cx + half + 1, y, cx, cy, rx, ry)) half++;
+                    while (half >= 0 && !point_in_ellipse(cx + half, y, cx, cy, rx, ry)) half--;
+                    
+                    span->x0 = fmax(left, cx - half);
+                    span->x1 = fmin(right, cx + half);
+                }
                 break;
                 
-            case ELLIPSE:
-                fprintf(file, "<ellipse cx=\"%d\" cy=\"%d\" rx=\"%d\" ry=\"%d\" ", 
-                        shape.data.ellipse.cx, shape.data.ellipse.cy,
-                        shape.data.ellipse.rx, shape.data.ellipse.ry);
+            case ROTATED_RECTANGLE:
+            case ROTATED_ELLIPSE:
+                compute_rotated_span(&shape, c, s, y, span);
+                break;
+                
+            case RECTANGLE:
+                // The clipped bounding box is the coverage
                 break;
         }
-        
-        fprintf(file, "fill=\"rgb(%d,%d,%d)\" fill-opacity=\"%.2f\" />\n", 
-                color.r, color.g, color.b, shape.alpha);
+    }
+}
+
+// Add (sign = 1) or remove (sign = -1) the pixels of [x0, x1] on row y
+void accumulate_span_stats(Image* current, Image* target, int y, int x0, int x1, int sign, CoverageStats* stats) {
+    if (x0 > x1) return;
+    
+    long long sum_d[3] = {0, 0, 0};
+    long long sum_du[3] = {0, 0, 0};
+    long long sum_u[3] = {0, 0, 0};
+    long long sum_uu[3] = {0, 0, 0};
+    
+    int idx = (y * current->width + x0) * 4;
+    for (int x = x0; x <= x1; x++) {
+        for (int c = 0; c < 3; c++) {
+            int u = current->data[idx + c];
+            int d = target->data[idx + c] - u;
+            sum_d[c] += d;
+            sum_du[c] += d * u;
+            sum_u[c] += u;
+            sum_uu[c] += u * u;
+        }
+        idx += 4;
     }
     
-    // SVG footer
-    fprintf(file, "</svg>\n");
+    for (int c = 0; c < 3; c++) {
+        stats->sum_d[c] += sign * sum_d[c];
+        stats->sum_du[c] += sign * sum_du[c];
+        stats->sum_u[c] += sign * sum_u[c];
+        stats->sum_uu[c] += sign * sum_uu[c];
+    }
+    stats->count += sign * (x1 - x0 + 1);
+}
+
+void compute_coverage_stats(Image* current, Image* target, Coverage* coverage, CoverageStats* stats) {
+    memset(stats, 0, sizeof(CoverageStats));
     
-    fclose(file);
+    for (int y = coverage->top; y <= coverage->bottom; y++) {
+        accumulate_span_stats(current, target, y, coverage->spans[y].x0, coverage->spans[y].x1, 1, stats);
+    }
 }
 
-Shape find_best_shape(State* state, int candidates) {
-    Shape best_shape;
-    float best_difference = INFINITY;
+// Move stats from old_coverage to new_coverage by visiting only the pixels
+// that left or entered coverage on each row
+void update_coverage_stats(Image* current, Image* target, Coverage* old_coverage, Coverage* new_coverage, CoverageStats* stats) {
+    int top = fmin(old_coverage->top, new_coverage->top);
+    int bottom = fmax(old_coverage->bottom, new_coverage->bottom);
     
-    for (int i = 0; i < candidates; i++) {
-        Shape shape = create_random_shape(state->current->width, state->current->height, 0.5f, state);
-        Color color = compute_optimal_color(state->current, state->target, shape);
-        shape.color = color;
-        
-        float diff_change = compute_difference_change_direct(state->current, state->target, shape, color);
+    for (int y = top; y <= bottom; y++) {
+        Span old_span = {0, -1};
+        Span new_span = {0, -1};
+        if (y >= old_coverage->top && y <= old_coverage->bottom) old_span = old_coverage->spans[y];
+        if (y >= new_coverage->top && y <= new_coverage->bottom) new_span = new_coverage->spans[y];
         
-        if (diff_change < best_difference) {
-            best_difference = diff_change;
-            best_shape = shape;
+        if (old_span.x0 > old_span.x1) {
+            accumulate_span_stats(current, target, y, new_span.x0, new_span.x1, 1, stats);
+        } else if (new_span.x0 > new_span.x1) {
+            accumulate_span_stats(current, target, y, old_span.x0, old_span.x1, -1, stats);
+        } else {
+            // Pixels that left coverage (old minus new)
+            accumulate_span_stats(current, target, y, old_span.x0, fmin(old_span.x1, new_span.x0 - 1), -1, stats);
+            accumulate_span_stats(current, target, y, fmax(old_span.x0, new_span.x1 + 1), old_span.x1, -1, stats);
+            
+            // Pixels that entered coverage (new minus old)
+            accumulate_span_stats(current, target, y, new_span.x0, fmin(new_span.x1, old_span.x0 - 1), 1, stats);
+            accumulate_span_stats(current, target, y, fmax(new_span.x0, old_span.x1 + 1), new_span.x1, 1, stats);
         }
     }
-    
-    return best_shape;
 }
 
-// OPTIMIZATION: Improved mutation strategy to match JavaScript implementation
-// Reset failure counter on success to allow more productive exploration
-Shape optimize_shape(State* state, Shape shape, int mutations) {
-    Shape best_shape = shape;
-    float best_difference = compute_difference_change_direct(state->current, state->target, shape, shape.color);
+// Same color as compute_optimal_color: mean of (target - current) / alpha + current
+Color compute_color_from_stats(CoverageStats* stats, float alpha) {
+    Color color = {0, 0, 0, 255};
+    
+    if (stats->count > 0) {
+        color.r = clamp_color((stats->sum_d[0] / alpha + stats->sum_u[0]) / stats->count);
+        color.g = clamp_color((stats->sum_d[1] / alpha + stats->sum_u[1]) / stats->count);
+        color.b = clamp_color((stats->sum_d[2] / alpha + stats->sum_u[2]) / stats->count);
+    }
+    
+    return color;
+}
+
+// Same result as compute_difference_change_direct. Per pixel and channel the
+// change is (d - a(c - u))^2 - d^2 = -2a(c d - d u) + a^2 (c^2 - 2 c u + u^2)
+float compute_difference_change_from_stats(CoverageStats* stats, Color color, float alpha) {
+    double a = alpha;
+    double channel[3] = {color.r, color.g, color.b};
+    double sum = 0;
+    
+    for (int c = 0; c < 3; c++) {
+        double v = channel[c];
+        sum += -2.0 * a * (v * stats->sum_d[c] - stats->sum_du[c]);
+        sum += a * a * (v * v * stats->count - 2.0 * v * stats->sum_u[c] + stats->sum_uu[c]);
+    }
+    
+    return (float)sum;
+}
+
+Color compute_average_color(Image* target) {
+    float r_sum = 0, g_sum = 0, b_sum = 0;
+    int total_pixels = target->width * target->height;
+    
+    for (int i = 0; i < total_pixels; i++) {
+        r_sum += target->data[i * 4];
+        g_sum += target->data[i * 4 + 1];
+        b_sum += target->data[i * 4 + 2];
+    }
+    
+    Color average_color = {
+        .r = (unsigned char)(r_sum / total_pixels),
+        .g = (unsigned char)(g_sum / total_pixels),
+        .b = (unsigned char)(b_sum / total_pixels),
+        .a = 255
+    };
+    
+    return average_color;
+}
+
+// Lowest difference change any color could reach on the pixels summed so far:
+// per channel the change is a quadratic in the color, minimized in closed form
+double min_difference_change(CoverageStats* stats, float alpha) {
+    if (stats->count == 0) return 0;
+    
+    double a = alpha;
+    double sum = 0;
+    for (int c = 0; c < 3; c++) {
+        double qa = a * a * stats->count;
+        double qb = -2.0 * a * stats->sum_d[c] - 2.0 * a * a * stats->sum_u[c];
+        double qc = 2.0 * a * stats->sum_du[c] + a * a * stats->sum_uu[c];
+        sum += qc - qb * qb / (4.0 * qa);
+    }
+    
+    return sum;
+}
+
+// Fill global_row_sums with prefix sums over pixels x0..x1 of row y
+void build_row_sums(Image* current, Image* target, int y, int x0, int x1) {
+    RowSums running;
+    memset(&running, 0, sizeof(RowSums));
+    global_row_sums[0] = running;
+    
+    int idx = (y * current->width + x0) * 4;
+    for (int x = x0; x <= x1; x++) {
+        for (int c = 0; c < 3; c++) {
+            int u = current->data[idx + c];
+            int d = target->data[idx + c] - u;
+            running.sum_d[c] += d;
+            running.sum_du[c] += d * u;
+            running.sum_u[c] += u;
+            running.sum_uu[c] += u * u;
+        }
+        global_row_sums[x - x0 + 1] = running;
+        idx += 4;
+    }
+}
+
+// Add pixels x0..x1 of the row whose prefix sums start at column origin
+void add_row_sums(int origin, int x0, int x1, CoverageStats* stats) {
+    RowSums* start = &global_row_sums[x0 - origin];
+    RowSums* end = &global_row_sums[x1 - origin + 1];
+    
+    for (int c = 0; c < 3; c++) {
+        stats->sum_d[c] += end->sum_d[c] - start->sum_d[c];
+        stats->sum_du[c] += end->sum_du[c] - start->sum_du[c];
+        stats->sum_u[c] += end->sum_u[c] - start->sum_u[c];
+        stats->sum_uu[c] += end->sum_uu[c] - start->sum_uu[c];
+    }
+    stats->count += x1 - x0 + 1;
+}
+
+// Finish a batch candidate whose rows have all been summed
+void finish_batch_candidate(Candidate* candidate, CoverageStats* stats) {
+    candidate->shape.color = compute_color_from_stats(stats, candidate->shape.alpha);
+    candidate->score = compute_difference_change_from_stats(stats, candidate->shape.color, candidate->shape.alpha);
+    candidate->exact = 1;
+}
+
+// Score up to CANDIDATE_BATCH candidates in one sweep down their rows, dropping any
+// that cannot beat bound. Returns the index of the best one that does, or -1
+int score_candidate_batch(State* state, Candidate** batch, int count, float bound) {
+    int width = state->current->width;
+    int height = state->current->height;
+    int order[CANDIDATE_BATCH];
+    int live[CANDIDATE_BATCH];
+    int ordered = 0;
+    int best = -1;
+    
+    // Without the prefix sum buffer every span is summed directly
+    int can_share = ensure_row_sums(width);
+    
+    for (int k = 0; k < count; k++) {
+        BatchEntry* entry = &global_batch_entries[k];
+        Coverage* coverage = &entry->coverage;
+        coverage->spans = &global_batch_spans[k * height];
+        compute_shape_coverage(width, height, batch[k]->shape, coverage);
+        memset(&entry->stats, 0, sizeof(CoverageStats));
+        
+        entry->remaining = 0;
+        for (int y = coverage->top; y <= coverage->bottom; y++) {
+            Span span = coverage->spans[y];
+            if (span.x0 <= span.x1) {
+                entry->remaining += state->row_residuals[y * (width + 1) + span.x1 + 1] - state->row_residuals[y * (width + 1) + span.x0];
+            }
+        }
+        
+        if (coverage->top > coverage->bottom) {
+            finish_batch_candidate(batch[k], &entry->stats);
+            if (batch[k]->score < bound) {
+                bound = batch[k]->score;
+                best = k;
+            }
+            continue;
+        }
+        
+        // Insertion sort by top row
+        int j = ordered++;
+        while (j > 0 && global_batch_entries[order[j - 1]].coverage.top > coverage->top) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = k;
+    }
+    
+    int next = 0;
+    int live_count = 0;
+    int y = 0;
+    while (next < ordered || live_count > 0) {
+        // Skip rows no candidate covers
+        if (live_count == 0 && global_batch_entries[order[next]].coverage.top > y) {
+            y = global_batch_entries[order[next]].coverage.top;
+        }
+        while (next < ordered && global_batch_entries[order[next]].coverage.top <= y) {
+            live[live_count++] = order[next++];
+        }
+        
+        // Sum the row once when the spans on it cover it more than twice over
+        int lo = width;
+        int hi = -1;
+        int covered = 0;
+        for (int j = 0; j < live_count; j++) {
+            Span span = global_batch_entries[live[j]].coverage.spans[y];
+            if (span.x0 > span.x1) continue;
+            lo = fmin(lo, span.x0);
+            hi = fmax(hi, span.x1);
+            covered += span.x1 - span.x0 + 1;
+        }
+        int shared = can_share && covered > 2 * (hi - lo + 1);
+        if (shared) build_row_sums(state->current, state->target, y, lo, hi);
+        
+        for (int j = 0; j < live_count;) {
+            int k = live[j];
+            BatchEntry* entry = &global_batch_entries[k];
+            Span span = entry->coverage.spans[y];
+            int done = 0;
+            
+            if (span.x0 <= span.x1) {
+                if (shared) {
+                    add_row_sums(lo, span.x0, span.x1, &entry->stats);
+                } else {
+                    accumulate_span_stats(state->current, state->target, y, span.x0, span.x1, 1, &entry->stats);
+                }
+                entry->remaining -= state->row_residuals[y * (width + 1) + span.x1 + 1] - state->row_residuals[y * (width + 1) + span.x0];
+            }
+            
+            if (y == entry->coverage.bottom) {
+                done = 1;
+                finish_batch_candidate(batch[k], &entry->stats);
+                if (batch[k]->score < bound) {
+                    bound = batch[k]->score;
+                    best = k;
+                }
+            } else if (span.x0 <= span.x1) {
+                float lower_bound = min_difference_change(&entry->stats, batch[k]->shape.alpha) - entry->remaining;
+                if (lower_bound >= bound) {
+                    done = 1;
+                    batch[k]->score = lower_bound;
+                    batch[k]->exact = 0;
+                }
+            }
+            
+            if (done) {
+                live[j] = live[--live_count];
+            } else {
+                j++;
+            }
+        }
+        
+        y++;
+    }
+    
+    return best;
+}
+
+State* init_state(Image* target, Color background, int use_triangles, int use_rectangles, int use_ellipses, int use_rotated_rectangles, int use_rotated_ellipses) {
+    // Compute average color of the target image
+    Color average_color = compute_average_color(target);
+
+    State* state = (State*)calloc(1, sizeof(State));
+    if (!state) return NULL;
+    state->target = target;
+    state->current = create_image(target->width, target->height);
+    state->shapes = (Shape*)malloc(MAX_SHAPES * sizeof(Shape));
+    state->tiles_x = (target->width + TILE_SIZE - 1) / TILE_SIZE;
+    state->tiles_y = (target->height + TILE_SIZE - 1) / TILE_SIZE;
+    state->tile_errors = (long long*)calloc(state->tiles_x * state->tiles_y, sizeof(long long));
+    state->focus_tiles = (int*)malloc(state->tiles_x * state->tiles_y * sizeof(int));
+    state->row_residuals = (unsigned int*)malloc((target->width + 1) * target->height * sizeof(unsigned int));
+    
+    if (!state->current || !state->current->data || !state->shapes || !state->tile_errors || !state->focus_tiles || !state->row_residuals) {
+        free_state(state);
+        return NULL;
+    }
+    
+    // Use computed average color instead of the passed background
+    fill_image(state->current, average_color);
+    state->background = average_color;
+    
+    state->shape_count = 0;
+    
+    // Seed the error maps; later updates only touch the damaged region
+    BoundingBox full = {0, 0, target->width, target->height};
+    update_error_maps(state, full);
+    state->initial_distance = state->distance;
+    
+    // Store shape type settings
+    state->use_triangles = use_triangles;
+    state->use_rectangles = use_rectangles;
+    state->use_ellipses = use_ellipses;
+    state->use_rotated_rectangles = use_rotated_rectangles;
+    state->use_rotated_ellipses = use_rotated_ellipses;
+    
+    // Initialize the global mask and span buffers
+    if (!ensure_mask_buffer(target->width, target->height) || !ensure_span_buffers(target->height)) {
+        free_state(state);
+        return NULL;
+    }
+    
+    return state;
+}
+
+void free_state(State* state) {
+    if (state) {
+        free_image(state->current);
+        free(state->shapes);
+        free(state->tile_errors);
+        free(state->focus_tiles);
+        free(state->row_residuals);
+        free(state->pool);
+        free(state);
+    }
+}
+
+// Recompute the tile errors and row residuals under bbox and update the total
+// error and distance
+void update_error_maps(State* state, BoundingBox bbox) {
+    int width = state->current->width;
+    int height = state->current->height;
+    int left = fmax(0, bbox.left);
+    int top = fmax(0, bbox.top);
+    int right = fmin(width - 1, bbox.left + bbox.width - 1);
+    int bottom = fmin(height - 1, bbox.top + bbox.height - 1);
+    
+    if (left <= right && top <= bottom) {
+        for (int ty = top / TILE_SIZE; ty <= bottom / TILE_SIZE; ty++) {
+            for (int tx = left / TILE_SIZE; tx <= right / TILE_SIZE; tx++) {
+                int tile_left = tx * TILE_SIZE;
+                int tile_top = ty * TILE_SIZE;
+                int tile_right = fmin(width - 1, tile_left + TILE_SIZE - 1);
+                int tile_bottom = fmin(height - 1, tile_top + TILE_SIZE - 1);
+                
+                long long* tile_error = &state->tile_errors[ty * state->tiles_x + tx];
+                state->total_error -= *tile_error;
+                *tile_error = compute_region_error(state->current, state->target, tile_left, tile_top, tile_right, tile_bottom);
+                state->total_error += *tile_error;
+            }
+        }
+        
+        // Prefix sums change from the first damaged pixel to the end of the row
+        for (int y = top; y <= bottom; y++) {
+            unsigned int* prefix = &state->row_residuals[y * (width + 1)];
+            int idx = (y * width + left) * 4;
+            if (left == 0) prefix[0] = 0;
+            for (int x = left; x < width; x++) {
+                int dr = state->current->data[idx] - state->target->data[idx];
+                int dg = state->current->data[idx + 1] - state->target->data[idx + 1];
+                int db = state->current->data[idx + 2] - state->target->data[idx + 2];
+                prefix[x + 1] = prefix[x] + dr * dr + dg * dg + db * db;
+                idx += 4;
+            }
+        }
+    }
+    
+    state->distance = distance_from_error(state->total_error, width * height);
+    invalidate_candidate_pool(state, bbox);
+}
+
+// Drop the scores of pooled candidates that overlap a changed region of the canvas
+void invalidate_candidate_pool(State* state, BoundingBox bbox) {
+    for (int i = 0; i < state->pool_size; i++) {
+        if (boxes_intersect(state->pool[i].shape.bbox, bbox)) {
+            state->pool[i].score = -INFINITY;
+            state->pool[i].exact = 0;
+        }
+    }
+}
+
+void add_shape_to_state(State* state, Shape shape) {
+    if (state->shape_count < MAX_SHAPES) {
+        state->shapes[state->shape_count++] = shape;
+        render_shape(state->current, shape);
+        update_error_maps(state, shape.bbox);
+    }
+}
+
+// Bytes the engine allocates for one optimizer of the given size: target and
+// current RGBA images, the one-byte mask, span buffers, error maps and shapes
+double estimate_optimizer_memory(int width, int height) {
+    double pixels = (double)width * height;
+    double tiles = (double)((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+    
+    return pixels * (4 + 4 + 1)
+        + (2.0 + CANDIDATE_BATCH) * height * sizeof(Span)
+        + (width + 1.0) * sizeof(RowSums)
+        + tiles * (sizeof(long long) + sizeof(int))
+        + (width + 1.0) * height * sizeof(unsigned int)
+        + MAX_SHAPES * sizeof(Shape)
+        + MAX_CANDIDATES * sizeof(Candidate)
+        + sizeof(State) + 2 * sizeof(Image);
+}
+
+// Append a color as #rgb when every channel has repeated hex digits, else #rrggbb
+int write_hex_color(char* out, Color color) {
+    if ((color.r >> 4) == (color.r & 15) && (color.g >> 4) == (color.g & 15) && (color.b >> 4) == (color.b & 15)) {
+        return snprintf(out, 8, "#%x%x%x", color.r & 15, color.g & 15, color.b & 15);
+    }
+    return snprintf(out, 8, "#%02x%02x%02x", color.r, color.g, color.b);
+}
+
+// Append an opacity with two decimals and no leading zero or trailing zeros (".5", ".47", "1")
+int write_opacity(char* out, float alpha) {
+    int hundredths = (int)lroundf(clamp(alpha, 0.0f, 1.0f) * 100.0f);
+    if (hundredths >= 100) return snprintf(out, 8, "1");
+    if (hundredths % 10 == 0) return snprintf(out, 8, ".%d", hundredths / 10);
+    return snprintf(out, 8, ".%02d", hundredths);
+}
+
+// Append formatted text at *p without writing past end. Once something does
+// not fit, *p stays at end and every later call writes nothing.
+void append_svg(char** p, char* end, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(*p, end - *p, format, args);
+    va_end(args);
+    *p = written < 0 || written >= end - *p ? end : *p + written;
+}
+
+// Write the SVG document scaled to out_width x out_height into one buffer.
+// The caller frees the result; NULL if it could not be allocated or filled
+char* write_svg(State* state, int out_width, int out_height, int pretty) {
+    // Every shape needs well under SVG_BYTES_PER_SHAPE, including its group tags
+    size_t capacity = 512 + (size_t)state->shape_count * SVG_BYTES_PER_SHAPE;
+    char* svg = (char*)malloc(capacity);
+    if (!svg) return NULL;
+    
+    const char* newline = pretty ? "\n" : "";
+    const char* indent = pretty ? "  " : "";
+    char* p = svg;
+    char* end = svg + capacity;
+    char color[8];
+    
+    append_svg(&p, end, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\" preserveAspectRatio=\"xMidYMid meet\">%s",
+               out_width, out_height, state->current->width, state->current->height, newline);
+    
+    // Background
+    write_hex_color(color, state->background);
+    append_svg(&p, end, "%s<rect width=\"100%%\" height=\"100%%\" fill=\"%s\"/>%s", indent, color, newline);
+    
+    char opacity[8];
+    char next_opacity[8];
+    int group_end = -1; // Index of the last shape in the open group, -1 when none is open
+    
+    for (int i = 0; i < state->shape_count; i++) {
+        Shape shape = state->shapes[i];
+        write_opacity(opacity, shape.alpha);
+        
+        // Open a group when this shape starts a run of two or more with the same opacity
+        if (group_end < i) {
+            group_end = i;
+            while (group_end + 1 < state->shape_count) {
+                write_opacity(next_opacity, state->shapes[group_end + 1].alpha);
+                if (strcmp(opacity, next_opacity) != 0) break;
+                group_end++;
+            }
+            
+            if (group_end > i) {
+                append_svg(&p, end, "%s<g fill-opacity=\"%s\">%s", indent, opacity, newline);
+            } else {
+                group_end = -1;
+            }
+        }
+        
+        int grouped = group_end >= i;
+        if (pretty) append_svg(&p, end, grouped ? "    " : "  ");
+        
+        switch(shape.type) {
+            case TRIANGLE:
+                append_svg(&p, end, "<path d=\"M%d %d %d %d %d %dZ\"",
+                           shape.data.triangle.x1, shape.data.triangle.y1,
+                           shape.data.triangle.x2, shape.data.triangle.y2,
+                           shape.data.triangle.x3, shape.data.triangle.y3);
+                break;
+                
+            case RECTANGLE:
+                append_svg(&p, end, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\"",
+                           shape.data.rectangle.x1, shape.data.rectangle.y1,
+                           shape.data.rectangle.x2 - shape.data.rectangle.x1,
+                           shape.data.rectangle.y2 - shape.data.rectangle.y1);
+                break;
+                
+            case ELLIPSE:
+                append_svg(&p, end, "<ellipse cx=\"%d\" cy=\"%d\" rx=\"%d\" ry=\"%d\"",
+                           shape.data.ellipse.cx, shape.data.ellipse.cy,
+                           shape.data.ellipse.rx, shape.data.ellipse.ry);
+                break;
+                
+            case ROTATED_RECTANGLE:
+                append_svg(&p, end, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" transform=\"rotate(%d %d %d)\"",
+                           shape.data.rotated.cx - shape.data.rotated.rx, shape.data.rotated.cy - shape.data.rotated.ry,
+                           2 * shape.data.rotated.rx, 2 * shape.data.rotated.ry,
+                           shape.data.rotated.angle, shape.data.rotated.cx, shape.data.rotated.cy);
+                break;
+                
+            case ROTATED_ELLIPSE:
+                append_svg(&p, end, "<ellipse cx=\"%d\" cy=\"%d\" rx=\"%d\" ry=\"%d\" transform=\"rotate(%d %d %d)\"",
+                           shape.data.rotated.cx, shape.data.rotated.cy,
+                           shape.data.rotated.rx, shape.data.rotated.ry,
+                           shape.data.rotated.angle, shape.data.rotated.cx, shape.data.rotated.cy);
+                break;
+        }
+        
+        write_hex_color(color, shape.color);
+        if (grouped) {
+            append_svg(&p, end, " fill=\"%s\"/>%s", color, newline);
+        } else {
+            append_svg(&p, end, " fill=\"%s\" fill-opacity=\"%s\"/>%s", color, opacity, newline);
+        }
+        
+        if (grouped && group_end == i) append_svg(&p, end, "%s</g>%s", indent, newline);
+    }
+    
+    // SVG footer
+    append_svg(&p, end, "</svg>%s", newline);
+    
+    // A full buffer means the size bound above is wrong; fail rather than truncate
+    if (p == end) {
+        free(svg);
+        return NULL;
+    }
+    
+    return svg;
+}
+
+void export_svg(State* state, const char* filename) {
+    char* svg = write_svg(state, state->current->width, state->current->height, 1);
+    if (!svg) return;
+    
+    FILE* file = fopen(filename, "w");
+    if (file) {
+        fputs(svg, file);
+        fclose(file);
+    }
+    
+    free(svg);
+}
+
+// Order candidates by score (or lower bound), most promising first
+int compare_candidates(const void* a, const void* b) {
+    float score_a = ((const Candidate*)a)->score;
+    float score_b = ((const Candidate*)b)->score;
+    return (score_a > score_b) - (score_a < score_b);
+}
+
+// Order candidates by estimated cost, cheapest first
+int compare_candidate_costs(const void* a, const void* b) {
+    return ((const Candidate*)a)->cost - ((const Candidate*)b)->cost;
+}
+
+// Random shape for the candidate pool. After a frame change it is sized for the
+// focus region and centered on a random pixel of one of the changed tiles.
+Shape new_candidate_shape(State* state) {
+    int width = state->current->width;
+    int height = state->current->height;
+    
+    if (state->focus_tile_count > 0) {
+        Shape shape = create_random_shape(state->focus.width, state->focus.height, 0.5f, state);
+        int tile = state->focus_tiles[random_int(0, state->focus_tile_count - 1)];
+        int left = (tile % state->tiles_x) * TILE_SIZE;
+        int top = (tile / state->tiles_x) * TILE_SIZE;
+        int x = random_int(left, fmin(width - 1, left + TILE_SIZE - 1));
+        int y = random_int(top, fmin(height - 1, top + TILE_SIZE - 1));
+        return offset_shape(shape, x - (shape.bbox.left + shape.bbox.width / 2), y - (shape.bbox.top + shape.bbox.height / 2));
+    }
+    return create_random_shape(width, height, 0.5f, state);
+}
+
+// Top up the candidate pool and rescore, in batches, the entries that could still
+// beat the best; the winner leaves the pool
+Shape find_best_shape(State* state, int candidates) {
+    if (candidates > state->pool_capacity) {
+        Candidate* pool = (Candidate*)realloc(state->pool, candidates * sizeof(Candidate));
+        if (pool) {
+            state->pool = pool;
+            state->pool_capacity = candidates;
+        }
+    }
+    if (candidates > state->pool_capacity) candidates = state->pool_capacity;
+    if (state->pool_size > candidates) state->pool_size = candidates;
+    
+    while (state->pool_size < candidates) {
+        Candidate* candidate = &state->pool[state->pool_size++];
+        candidate->shape = new_candidate_shape(state);
+        candidate->score = -INFINITY;
+        candidate->exact = 0;
+        candidate->cost = estimate_shape_cost(candidate->shape, state->current->width, state->current->height);
+    }
+    
+    // Cheap candidates first: a small first batch of them sets the bound, so the
+    // expensive ones that cannot win are cut after few rows or skipped outright
+    qsort(state->pool, state->pool_size, sizeof(Candidate), compare_candidate_costs);
+    
+    if (!ensure_span_buffers(state->current->height)) return new_candidate_shape(state);
+    
+    int best = -1;
+    float best_difference = INFINITY;
+    for (int i = 0; i < state->pool_size; i++) {
+        if (state->pool[i].exact && state->pool[i].score < best_difference) {
+            best = i;
+            best_difference = state->pool[i].score;
+        }
+    }
+    
+    // Score the rest in batches that share their row sweeps
+    Candidate* batch[CANDIDATE_BATCH];
+    int batch_index[CANDIDATE_BATCH];
+    int batch_limit = BOUND_BATCH;
+    int i = 0;
+    while (i < state->pool_size) {
+        int batch_size = 0;
+        for (; i < state->pool_size && batch_size < batch_limit; i++) {
+            Candidate* candidate = &state->pool[i];
+            if (candidate->exact || candidate->score >= best_difference) continue;
+            batch_index[batch_size] = i;
+            batch[batch_size++] = candidate;
+        }
+        
+        batch_limit = CANDIDATE_BATCH;
+        int k = score_candidate_batch(state, batch, batch_size, best_difference);
+        if (k >= 0) {
+            best = batch_index[k];
+            best_difference = state->pool[best].score;
+        }
+    }
+    
+    if (best < 0) return new_candidate_shape(state);
+    Shape best_shape = state->pool[best].shape;
+    
+    int kept = 0;
+    for (i = 0; i < state->pool_size; i++) {
+        if (i != best && state->pool[i].score < 0) {
+            state->pool[kept++] = state->pool[i];
+        }
+    }
+    
+    // Carry over only the most promising share so every step still draws fresh shapes
+    qsort(state->pool, kept, sizeof(Candidate), compare_candidates);
+    state->pool_size = fmin(kept, candidates * POOL_KEEP_FRACTION);
+    
+    return best_shape;
+}
+
+// OPTIMIZATION: Improved mutation strategy to match JavaScript implementation
+// Reset failure counter on success to allow more productive exploration.
+Shape optimize_shape(State* state, Shape shape, int mutations) {
+    int width = state->current->width;
+    int height = state->current->height;
+    if (!ensure_span_buffers(height)) return shape;
+    
+    Coverage best_coverage = {global_span_buffers[0], 0, -1};
+    Coverage mutated_coverage = {global_span_buffers[1], 0, -1};
+    CoverageStats best_stats;
+    
+    compute_shape_coverage(width, height, shape, &best_coverage);
+    compute_coverage_stats(state->current, state->target, &best_coverage, &best_stats);
+    
+    Shape best_shape = shape;
+    float best_difference = compute_difference_change_from_stats(&best_stats, shape.color, shape.alpha);
     int failed_attempts = 0;
     int total_attempts = 0;
     
@@ -827,15 +2006,26 @@ Shape optimize_shape(State* state, Shape shape, int mutations) {
         total_attempts++;
         
         Shape mutated = mutate_shape(best_shape, best_shape.alpha);
-        Color color = compute_optimal_color(state->current, state->target, mutated);
+        compute_shape_coverage(width, height, mutated, &mutated_coverage);
+        
+        CoverageStats stats = best_stats;
+        update_coverage_stats(state->current, state->target, &best_coverage, &mutated_coverage, &stats);
+        
+        Color color = compute_color_from_stats(&stats, mutated.alpha);
         mutated.color = color;
         
-        float diff_change = compute_difference_change_direct(state->current, state->target, mutated, color);
+        float diff_change = compute_difference_change_from_stats(&stats, color, mutated.alpha);
         
         if (diff_change < best_difference) {
             // Found an improvement - reset the failure counter
             best_difference = diff_change;
             best_shape = mutated;
+            best_stats = stats;
+            
+            // The mutated coverage becomes the cached best; its old buffer is reused
+            Coverage swap = best_coverage;
+            best_coverage = mutated_coverage;
+            mutated_coverage = swap;
             failed_attempts = 0;  // Reset on success
         } else {
             // No improvement - count as a failure
@@ -848,6 +2038,7 @@ Shape optimize_shape(State* state, Shape shape, int mutations) {
 
 void run_optimizer(State* state, int steps, int candidates, int mutations) {
     init_random();
+    if (!ensure_span_buffers(state->current->height)) return;
     
     for (int step = 0; step < steps; step++) {
         // Find the best shape among candidates
@@ -865,18 +2056,504 @@ void run_optimizer(State* state, int steps, int candidates, int mutations) {
     }
 }
 
+// Work item for one region of a partitioned run
+typedef struct {
+    State* region;
+    int steps;
+    int candidates;
+    int mutations;
+    Shape* shapes; // Shapes found, in region coordinates
+} RegionJob;
+
+// Create a state over the given crop of state's target and current image
+State* create_region_state(State* state, int left, int top, int width, int height) {
+    Image* target = create_image(width, height);
+    if (!target || !target->data) {
+        free_image(target);
+        return NULL;
+    }
+    
+    for (int y = 0; y < height; y++) {
+        memcpy(&target->data[y * width * 4], &state->target->data[((top + y) * state->target->width + left) * 4], width * 4);
+    }
+    
+    State* region = init_state(target, state->background, state->use_triangles, state->use_rectangles, state->use_ellipses,
+                               state->use_rotated_rectangles, state->use_rotated_ellipses);
+    if (!region) {
+        free_image(target);
+        return NULL;
+    }
+    
+    // Start from the shared canvas rather than the crop's average color
+    for (int y = 0; y < height; y++) {
+        memcpy(&region->current->data[y * width * 4], &state->current->data[((top + y) * state->current->width + left) * 4], width * 4);
+    }
+    BoundingBox full = {0, 0, width, height};
+    update_error_maps(region, full);
+    region->initial_distance = state->initial_distance;
+    
+    return region;
+}
+
+// Translate a shape and its bounding box by (dx, dy)
+Shape offset_shape(Shape shape, int dx, int dy) {
+    switch(shape.type) {
+        case TRIANGLE:
+            shape.data.triangle.x1 += dx;
+            shape.data.triangle.y1 += dy;
+            shape.data.triangle.x2 += dx;
+            shape.data.triangle.y2 += dy;
+            shape.data.triangle.x3 += dx;
+            shape.data.triangle.y3 += dy;
+            break;
+            
+        case RECTANGLE:
+            shape.data.rectangle.x1 += dx;
+            shape.data.rectangle.y1 += dy;
+            shape.data.rectangle.x2 += dx;
+            shape.data.rectangle.y2 += dy;
+            break;
+            
+        case ELLIPSE:
+            shape.data.ellipse.cx += dx;
+            shape.data.ellipse.cy += dy;
+            break;
+            
+        case ROTATED_RECTANGLE:
+        case ROTATED_ELLIPSE:
+            shape.data.rotated.cx += dx;
+            shape.data.rotated.cy += dy;
+            break;
+    }
+    
+    shape.bbox.left += dx;
+    shape.bbox.top += dy;
+    return shape;
+}
+
+// Run an independent optimizer on one region. Touches only the region's own
+// state and the calling thread's buffers, so regions can run concurrently.
+void* run_region_job(void* arg) {
+    RegionJob* job = (RegionJob*)arg;
+    
+    // This thread's scratch buffers; without them the region adds no shapes
+    if (!ensure_span_buffers(job->region->current->height)) job->steps = 0;
+    
+    for (int step = 0; step < job->steps; step++) {
+        Shape best_shape = find_best_shape(job->region, job->candidates);
+        Shape optimized = optimize_shape(job->region, best_shape, job->mutations);
+        add_shape_to_state(job->region, optimized);
+        job->shapes[step] = optimized;
+    }
+    
+#ifdef USE_THREADS
+    free_global_buffers();
+#endif
+    return NULL;
+}
+
+// Release a region state and its cropped target
+void free_region_state(State* region) {
+    if (region) {
+        free_image(region->target);
+        free_state(region);
+    }
+}
+
+// Optimize grid x grid overlapping regions independently and merge their shapes
+// into state, refining seam shapes. Returns the number of shapes added
+int run_partitioned_optimizer(State* state, int grid, int steps, int candidates, int mutations) {
+    int width = state->current->width;
+    int height = state->current->height;
+    
+    if (steps <= 0) return 0;
+    grid = fmax(1, fmin(MAX_REGION_GRID, grid));
+    int region_count = grid * grid;
+    
+    RegionJob jobs[region_count];
+    int core_left[region_count], core_top[region_count], core_right[region_count], core_bottom[region_count];
+    int offset_x[region_count], offset_y[region_count], region_width[region_count], region_height[region_count];
+    int max_width = 0, max_height = 0;
+    
+    for (int i = 0; i < region_count; i++) {
+        int gx = i % grid;
+        int gy = i / grid;
+        core_left[i] = gx * width / grid;
+        core_top[i] = gy * height / grid;
+        core_right[i] = (gx + 1) * width / grid - 1;
+        core_bottom[i] = (gy + 1) * height / grid - 1;
+        
+        offset_x[i] = fmax(0, core_left[i] - REGION_OVERLAP);
+        offset_y[i] = fmax(0, core_top[i] - REGION_OVERLAP);
+        region_width[i] = fmin(width - 1, core_right[i] + REGION_OVERLAP) - offset_x[i] + 1;
+        region_height[i] = fmin(height - 1, core_bottom[i] + REGION_OVERLAP) - offset_y[i] + 1;
+        max_width = fmax(max_width, region_width[i]);
+        max_height = fmax(max_height, region_height[i]);
+    }
+    
+#ifdef USE_THREADS
+    int concurrent = region_count;
+#else
+    int concurrent = 1;
+#endif
+    double needed = estimate_optimizer_memory(width, height) + concurrent * estimate_optimizer_memory(max_width, max_height);
+    if (memory_limit_bytes > 0 && needed > memory_limit_bytes) {
+        int before = state->shape_count;
+        run_optimizer(state, steps, candidates, mutations);
+        return state->shape_count - before;
+    }
+    
+    int ready = 1;
+    for (int i = 0; i < region_count; i++) {
+        // Spread the shape budget evenly over the regions
+        jobs[i].steps = steps / region_count + (i < steps % region_count ? 1 : 0);
+        jobs[i].candidates = candidates;
+        jobs[i].mutations = mutations;
+        jobs[i].region = NULL;
+        jobs[i].shapes = (Shape*)malloc((jobs[i].steps + 1) * sizeof(Shape));
+        if (!jobs[i].shapes) ready = 0;
+    }
+    
+#ifdef USE_THREADS
+    for (int i = 0; i < region_count && ready; i++) {
+        jobs[i].region = create_region_state(state, offset_x[i], offset_y[i], region_width[i], region_height[i]);
+        if (!jobs[i].region) ready = 0;
+    }
+    
+    if (ready) {
+        pthread_t threads[region_count];
+        int started[region_count];
+        for (int i = 0; i < region_count; i++) {
+            // A region whose thread cannot start runs on this one
+            started[i] = pthread_create(&threads[i], NULL, run_region_job, &jobs[i]) == 0;
+            if (!started[i]) run_region_job(&jobs[i]);
+        }
+        for (int i = 0; i < region_count; i++) {
+            if (started[i]) pthread_join(threads[i], NULL);
+        }
+    }
+    
+    for (int i = 0; i < region_count; i++) {
+        free_region_state(jobs[i].region);
+        jobs[i].region = NULL;
+    }
+#else
+    // Every region crops the same canvas, so running them one after another
+    // before the merge gives the same result as running them side by side
+    for (int i = 0; i < region_count && ready; i++) {
+        jobs[i].region = create_region_state(state, offset_x[i], offset_y[i], region_width[i], region_height[i]);
+        if (!jobs[i].region) {
+            ready = 0;
+            break;
+        }
+        run_region_job(&jobs[i]);
+        free_region_state(jobs[i].region);
+        jobs[i].region = NULL;
+    }
+#endif
+    
+    int added = 0;
+    
+    if (ready && ensure_span_buffers(height)) {
+        Coverage coverage = {global_span_buffers[0], 0, -1};
+        CoverageStats stats;
+        
+        // Merge into one ordered list, refining seam shapes against the full canvas
+        int max_steps = steps / region_count + 1;
+        for (int step = 0; step < max_steps; step++) {
+            for (int i = 0; i < region_count; i++) {
+                if (step >= jobs[i].steps) continue;
+                
+                Shape shape = offset_shape(jobs[i].shapes[step], offset_x[i], offset_y[i]);
+                compute_shape_coverage(width, height, shape, &coverage);
+                compute_coverage_stats(state->current, state->target, &coverage, &stats);
+                shape.color = compute_color_from_stats(&stats, shape.alpha);
+                
+                int straddles = shape.bbox.left < core_left[i] || shape.bbox.top < core_top[i] ||
+                                shape.bbox.left + shape.bbox.width - 1 > core_right[i] ||
+                                shape.bbox.top + shape.bbox.height - 1 > core_bottom[i];
+                if (straddles) {
+                    shape = optimize_shape(state, shape, mutations);
+                    compute_shape_coverage(width, height, shape, &coverage);
+                    compute_coverage_stats(state->current, state->target, &coverage, &stats);
+                }
+                
+                if (compute_difference_change_from_stats(&stats, shape.color, shape.alpha) < 0) {
+                    add_shape_to_state(state, shape);
+                    added++;
+                }
+            }
+        }
+    }
+    
+    for (int i = 0; i < region_count; i++) {
+        free(jobs[i].shapes);
+    }
+    
+    return added;
+}
+
+// Refit a shape's alpha and color against the current canvas using its coverage
+// sums. Returns the resulting difference change (negative means it helps).
+float refit_shape_color(State* state, Shape* shape, Coverage* coverage) {
+    static const float alpha_steps[] = {-0.1f, -0.05f, 0.0f, 0.05f, 0.1f};
+    CoverageStats stats;
+    
+    compute_shape_coverage(state->current->width, state->current->height, *shape, coverage);
+    compute_coverage_stats(state->current, state->target, coverage, &stats);
+    
+    float base_alpha = shape->alpha;
+    float best_difference = INFINITY;
+    
+    for (int i = 0; i < (int)(sizeof(alpha_steps) / sizeof(alpha_steps[0])); i++) {
+        float alpha = clamp(base_alpha + alpha_steps[i], 0.1f, 1.0f);
+        Color color = compute_color_from_stats(&stats, alpha);
+        float diff_change = compute_difference_change_from_stats(&stats, color, alpha);
+        
+        if (diff_change < best_difference) {
+            best_difference = diff_change;
+            shape->alpha = alpha;
+            shape->color = color;
+        }
+    }
+    
+    return best_difference;
+}
+
+// Keep the shape list for the next frame, refitting or dropping each shape.
+// Returns the number of shapes kept, or -1 if buffers could not be allocated
+int warm_start_frame(State* state, unsigned char* target_data) {
+    Image* target = state->target;
+    int width = target->width;
+    int height = target->height;
+    if (!ensure_span_buffers(height)) return -1;
+    int focus_left = width, focus_top = height, focus_right = -1, focus_bottom = -1;
+    state->focus_tile_count = 0;
+    
+    // Find the tiles whose target changed noticeably
+    for (int ty = 0; ty < state->tiles_y; ty++) {
+        for (int tx = 0; tx < state->tiles_x; tx++) {
+            int left = tx * TILE_SIZE;
+            int top = ty * TILE_SIZE;
+            int right = fmin(width - 1, left + TILE_SIZE - 1);
+            int bottom = fmin(height - 1, top + TILE_SIZE - 1);
+            long long change = 0;
+            
+            for (int y = top; y <= bottom; y++) {
+                int idx = (y * width + left) * 4;
+                for (int x = left; x <= right; x++) {
+                    int dr = target_data[idx] - target->data[idx];
+                    int dg = target_data[idx + 1] - target->data[idx + 1];
+                    int db = target_data[idx + 2] - target->data[idx + 2];
+                    change += dr * dr + dg * dg + db * db;
+                    idx += 4;
+                }
+            }
+            
+            int pixels = (right - left + 1) * (bottom - top + 1);
+            if (change > (long long)FRAME_CHANGE_THRESHOLD * 3 * pixels) {
+                state->focus_tiles[state->focus_tile_count++] = ty * state->tiles_x + tx;
+                focus_left = fmin(focus_left, left);
+                focus_top = fmin(focus_top, top);
+                focus_right = fmax(focus_right, right);
+                focus_bottom = fmax(focus_bottom, bottom);
+            }
+        }
+    }
+    
+    // Pooled candidates were placed for the old focus and scored against the old target
+    state->pool_size = 0;
+    
+    // An unchanged frame keeps refining the whole image
+    if (focus_right < 0) {
+        state->focus = (BoundingBox){0, 0, 0, 0};
+    } else {
+        state->focus = (BoundingBox){focus_left, focus_top, focus_right - focus_left + 1, focus_bottom - focus_top + 1};
+    }
+    
+    memcpy(target->data, target_data, width * height * 4 * sizeof(unsigned char));
+    
+    // Rebuild the canvas from the new average color, refitting shapes in order
+    Color average_color = compute_average_color(target);
+    fill_image(state->current, average_color);
+    state->background = average_color;
+    
+    Coverage coverage = {global_span_buffers[0], 0, -1};
+    int kept = 0;
+    
+    for (int i = 0; i < state->shape_count; i++) {
+        Shape shape = state->shapes[i];
+        
+        if (refit_shape_color(state, &shape, &coverage) < 0) {
+            state->shapes[kept++] = shape;
+            render_shape(state->current, shape);
+        }
+    }
+    
+    state->shape_count = kept;
+    BoundingBox full = {0, 0, width, height};
+    update_error_maps(state, full);
+    
+    return kept;
+}
+
+int boxes_intersect(BoundingBox a, BoundingBox b) {
+    return a.left < b.left + b.width && b.left < a.left + a.width &&
+           a.top < b.top + b.height && b.top < a.top + a.height;
+}
+
+// Render everything but shape skip into region_img, whose origin is (left, top).
+// Returns the number of bounding box pixels rendered
+long long render_region_without(State* state, Image* region_img, int left, int top, int skip) {
+    BoundingBox region = {left, top, region_img->width, region_img->height};
+    long long work = (long long)region.width * region.height;
+    fill_image(region_img, state->background);
+    
+    for (int i = 0; i < state->shape_count; i++) {
+        BoundingBox bbox = state->shapes[i].bbox;
+        if (i == skip || !boxes_intersect(bbox, region)) continue;
+        render_shape(region_img, offset_shape(state->shapes[i], -left, -top));
+        
+        int overlap_width = fmin(bbox.left + bbox.width, left + region.width) - fmax(bbox.left, left);
+        int overlap_height = fmin(bbox.top + bbox.height, top + region.height) - fmax(bbox.top, top);
+        work += (long long)overlap_width * overlap_height;
+    }
+    
+    return work;
+}
+
+// Squared error of region_img against the target area starting at (left, top)
+long long compute_offset_error(Image* region_img, Image* target, int left, int top) {
+    long long sum = 0;
+    
+    for (int y = 0; y < region_img->height; y++) {
+        int idx = y * region_img->width * 4;
+        int target_idx = ((top + y) * target->width + left) * 4;
+        for (int x = 0; x < region_img->width; x++) {
+            int dr = region_img->data[idx] - target->data[target_idx];
+            int dg = region_img->data[idx + 1] - target->data[target_idx + 1];
+            int db = region_img->data[idx + 2] - target->data[target_idx + 2];
+            sum += dr * dr + dg * dg + db * db;
+            idx += 4;
+            target_idx += 4;
+        }
+    }
+    
+    return sum;
+}
+
+// Drop shapes whose removal costs less than threshold similarity points and
+// refit the ones above them. Returns the number of shapes removed
+int prune_shapes(State* state, float threshold) {
+    int width = state->current->width;
+    int height = state->current->height;
+    int pixels = width * height;
+    int removed = 0;
+    long long work = 0;
+    long long budget = (long long)PRUNE_WORK_PER_PIXEL * pixels;
+    
+    char* needs_refit = (char*)calloc(state->shape_count > 0 ? state->shape_count : 1, sizeof(char));
+    if (!needs_refit || !ensure_span_buffers(height)) {
+        free(needs_refit);
+        return 0;
+    }
+    
+    for (int i = state->shape_count - 1; i >= 0 && work < budget; i--) {
+        Shape shape = state->shapes[i];
+        int left = fmax(0, shape.bbox.left);
+        int top = fmax(0, shape.bbox.top);
+        int right = fmin(width - 1, shape.bbox.left + shape.bbox.width - 1);
+        int bottom = fmin(height - 1, shape.bbox.top + shape.bbox.height - 1);
+        
+        Image* region_img = NULL;
+        int drop = left > right || top > bottom;
+        
+        if (!drop) {
+            region_img = create_image(right - left + 1, bottom - top + 1);
+            if (!region_img || !region_img->data) {
+                free_image(region_img);
+                break;
+            }
+            
+            work += render_region_without(state, region_img, left, top, i);
+            long long error_with = compute_region_error(state->current, state->target, left, top, right, bottom);
+            long long error_without = compute_offset_error(region_img, state->target, left, top);
+            
+            // Similarity lost by removing this shape
+            float loss = (distance_from_error(state->total_error - error_with + error_without, pixels) - state->distance) * 100.0f;
+            drop = loss < threshold;
+        }
+        
+        if (drop) {
+            if (region_img) {
+                for (int y = top; y <= bottom; y++) {
+                    memcpy(&state->current->data[(y * width + left) * 4], &region_img->data[(y - top) * region_img->width * 4], region_img->width * 4);
+                }
+                BoundingBox damaged = {left, top, right - left + 1, bottom - top + 1};
+                update_error_maps(state, damaged);
+            }
+            
+            // Later shapes painted over this one were fit against a canvas that changed
+            for (int j = i + 1; j < state->shape_count; j++) {
+                if (boxes_intersect(state->shapes[j].bbox, shape.bbox)) needs_refit[j] = 1;
+            }
+            
+            memmove(&state->shapes[i], &state->shapes[i + 1], (state->shape_count - i - 1) * sizeof(Shape));
+            memmove(&needs_refit[i], &needs_refit[i + 1], state->shape_count - i - 1);
+            state->shape_count--;
+            removed++;
+        }
+        
+        free_image(region_img);
+    }
+    
+    if (removed > 0) {
+        // Repaint in order, refitting the neighbors of dropped shapes
+        Coverage coverage = {global_span_buffers[0], 0, -1};
+        fill_image(state->current, state->background);
+        
+        for (int i = 0; i < state->shape_count; i++) {
+            if (needs_refit[i]) {
+                refit_shape_color(state, &state->shapes[i], &coverage);
+            }
+            render_shape(state->current, state->shapes[i]);
+        }
+        
+        BoundingBox full = {0, 0, width, height};
+        update_error_maps(state, full);
+    }
+    
+    free(needs_refit);
+    return removed;
+}
+
 // WebAssembly exports implementation
 EMSCRIPTEN_KEEPALIVE
-void* create_optimizer(int width, int height, unsigned char* target_data, int bg_r, int bg_g, int bg_b, int use_triangles, int use_rectangles, int use_ellipses) {
+void* create_optimizer(int width, int height, unsigned char* target_data, int bg_r, int bg_g, int bg_b, int use_triangles, int use_rectangles, int use_ellipses, int use_rotated_rectangles, int use_rotated_ellipses) {
     init_random();
     
+    // Fail fast instead of growing memory until the allocation gives out
+    if (width <= 0 || height <= 0) return NULL;
+    if (memory_limit_bytes > 0 && estimate_optimizer_memory(width, height) > memory_limit_bytes) {
+        printf("Optimizer for %dx%d exceeds the memory limit of %.0f bytes\n", width, height, memory_limit_bytes);
+        return NULL;
+    }
+    
     // Create target image
     Image* target = create_image(width, height);
+    if (!target || !target->data) {
+        free_image(target);
+        return NULL;
+    }
     memcpy(target->data, target_data, width * height * 4 * sizeof(unsigned char));
     
     // Create state with the provided background color and shape settings
     Color background = {bg_r, bg_g, bg_b, 255};
-    State* state = init_state(target, background, use_triangles, use_rectangles, use_ellipses);
+    State* state = init_state(target, background, use_triangles, use_rectangles, use_ellipses, use_rotated_rectangles, use_rotated_ellipses);
+    if (!state) {
+        free_image(target);
+        return NULL;
+    }
     
     return state;
 }
@@ -887,6 +2564,31 @@ void run_optimization(void* state_ptr, int steps, int candidates, int mutations)
     run_optimizer(state, steps, candidates, mutations);
 }
 
+EMSCRIPTEN_KEEPALIVE
+int run_partitioned_optimization(void* state_ptr, int grid, int steps, int candidates, int mutations) {
+    State* state = (State*)state_ptr;
+    init_random();
+    return run_partitioned_optimizer(state, grid, steps, candidates, mutations);
+}
+
+EMSCRIPTEN_KEEPALIVE
+int load_next_frame(void* state_ptr, unsigned char* target_data) {
+    State* state = (State*)state_ptr;
+    return warm_start_frame(state, target_data);
+}
+
+EMSCRIPTEN_KEEPALIVE
+int get_shape_count(void* state_ptr) {
+    State* state = (State*)state_ptr;
+    return state->shape_count;
+}
+
+EMSCRIPTEN_KEEPALIVE
+int prune_optimizer_shapes(void* state_ptr, float threshold) {
+    State* state = (State*)state_ptr;
+    return prune_shapes(state, threshold);
+}
+
 EMSCRIPTEN_KEEPALIVE
 unsigned char* get_current_image(void* state_ptr) {
     State* state = (State*)state_ptr;
@@ -902,24 +2604,13 @@ float get_current_similarity(void* state_ptr) {
 EMSCRIPTEN_KEEPALIVE
 char* export_svg_string(void* state_ptr) {
     State* state = (State*)state_ptr;
-    
-    // Export to a temporary file
-    export_svg(state, "temp.svg");
-    
-    // Read the file back into memory
-    FILE* file = fopen("temp.svg", "r");
-    if (!file) return NULL;
-    
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    char* svg_string = (char*)malloc(size + 1);
-    fread(svg_string, 1, size, file);
-    svg_string[size] = '\0';
-    
-    fclose(file);
-    return svg_string;
+    return write_svg(state, state->current->width, state->current->height, 1);
+}
+
+EMSCRIPTEN_KEEPALIVE
+char* export_svg_scaled(void* state_ptr, int out_width, int out_height, int pretty) {
+    State* state = (State*)state_ptr;
+    return write_svg(state, out_width, out_height, pretty);
 }
 
 EMSCRIPTEN_KEEPALIVE
@@ -928,10 +2619,11 @@ void free_optimizer(void* state_ptr) {
     free_image(state->target);
     free_state(state);
     
-    // Free global mask buffer when optimizer is freed
-    if (global_mask_buffer) {
-        free(global_mask_buffer);
-        global_mask_buffer = NULL;
-        global_mask_buffer_size = 0;
-    }
+    // Free global buffers when optimizer is freed
+    free_global_buffers();
+}
+
+EMSCRIPTEN_KEEPALIVE
+void set_memory_limit(double bytes) {
+    memory_limit_bytes = bytes;
 }
\ No newline at end of file